@@ -0,0 +1,1251 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "memory.h"
+#include "table.h"
+#include "vm.h"
+
+// both kinds of files are a header followed by a body
+//
+// numbers are written in the native byte order, the files are only meant for
+// the machine which wrote them
+//
+// the files are mapped when they are loaded, and the code and lines of every
+// chunk are used in place, they are padded to keep the lines aligned for that
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    // the source a cache was compiled from, zero for images
+    uint32_t sourceLength;
+    uint32_t sourceHash;
+    // the rest of the file, a damaged file is rejected instead of run
+    uint32_t bodyHash;
+} Header;
+
+#define FNV_OFFSET 2166136261u
+
+// FNV-1a which can be continued over several pieces
+static uint32_t hashBytes(uint32_t hash, const void *bytes, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= ((const uint8_t *)bytes)[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static Header makeHeader(const char *magic, const char *source)
+{
+    Header header;
+    memcpy(header.magic, magic, 4);
+    header.version = BYTECODE_VERSION;
+    header.sourceLength = source != NULL ? (uint32_t)strlen(source) : 0;
+    header.sourceHash =
+        source != NULL ? hashString(source, (int)header.sourceLength) : 0;
+    header.bodyHash = FNV_OFFSET;
+    return header;
+}
+
+typedef struct
+{
+    FILE *file;
+    // of everything written after the header
+    uint32_t hash;
+    size_t offset;
+} Writer;
+
+static void writeBytes(Writer *writer, const void *bytes, size_t size)
+{
+    fwrite(bytes, 1, size, writer->file);
+    writer->hash = hashBytes(writer->hash, bytes, size);
+    writer->offset += size;
+}
+
+static void writePadding(Writer *writer, size_t alignment)
+{
+    static const uint8_t zeros[16] = {0};
+    writeBytes(writer, zeros, (alignment - writer->offset % alignment) %
+                                  alignment);
+}
+
+static void writeByte(Writer *writer, uint8_t byte)
+{
+    writeBytes(writer, &byte, 1);
+}
+
+static void writeInt(Writer *writer, int32_t value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeChars(Writer *writer, const char *chars, int length)
+{
+    writeInt(writer, length);
+    writeBytes(writer, chars, length);
+}
+
+// arity, upvalue count, max stack size, loop count, code count, code, padding,
+// lines
+static void writeFunctionCode(Writer *writer, ObjFunction *function)
+{
+    writeInt(writer, function->arity);
+    writeInt(writer, function->upvalueCount);
+    writeInt(writer, function->maxStackSize);
+    writeInt(writer, function->loopCount);
+
+    // quickened instructions are written as their generic form, the code is
+    // mapped read only when it is loaded and never quickened again
+    Chunk *chunk = &function->chunk;
+    writeInt(writer, chunk->count);
+    for (int offset = 0; offset < chunk->count;)
+    {
+        int length = instructionLength(chunk, offset);
+        writeByte(writer, genericOp(chunk->code[offset]));
+        writeBytes(writer, &chunk->code[offset + 1], length - 1);
+        offset += length;
+    }
+    writePadding(writer, sizeof(int));
+    writeBytes(writer, chunk->lines, sizeof(int) * chunk->count);
+}
+
+typedef void (*WriteBody)(Writer *writer, void *data);
+
+// the file is written next to its final name and renamed over it, so other
+// processes never read a half written file
+static bool writeFile(const char *path, Header header, WriteBody writeBody,
+                      void *data)
+{
+    size_t length = strlen(path);
+    char *temporary = (char *)malloc(length + 32);
+    if (temporary == NULL)
+        return false;
+    snprintf(temporary, length + 32, "%s.%ld.tmp", path, (long)getpid());
+
+    FILE *file = fopen(temporary, "wb");
+    if (file == NULL)
+    {
+        free(temporary);
+        return false;
+    }
+
+    // the header is written again once the hash of the body is known
+    fwrite(&header, sizeof(header), 1, file);
+    Writer writer = {file, FNV_OFFSET, sizeof(header)};
+    writeBody(&writer, data);
+    header.bodyHash = writer.hash;
+    rewind(file);
+    fwrite(&header, sizeof(header), 1, file);
+
+    bool written = !ferror(file);
+    written = fclose(file) == 0 && written;
+    if (written)
+        written = rename(temporary, path) == 0;
+    if (!written)
+        remove(temporary);
+    free(temporary);
+    return written;
+}
+
+typedef struct
+{
+    uint8_t *start;
+    uint8_t *current;
+    uint8_t *end;
+    int depth;
+} Reader;
+
+static bool hasBytes(Reader *reader, size_t size)
+{
+    return (size_t)(reader->end - reader->current) >= size;
+}
+
+static bool readBytes(Reader *reader, void *bytes, size_t size)
+{
+    if (!hasBytes(reader, size))
+        return false;
+    memcpy(bytes, reader->current, size);
+    reader->current += size;
+    return true;
+}
+
+// the bytes are used in place, NULL if there are not enough of them
+static uint8_t *skipBytes(Reader *reader, size_t size)
+{
+    if (!hasBytes(reader, size))
+        return NULL;
+    uint8_t *bytes = reader->current;
+    reader->current += size;
+    return bytes;
+}
+
+static bool skipPadding(Reader *reader, size_t alignment)
+{
+    size_t offset = reader->current - reader->start;
+    return skipBytes(reader, (alignment - offset % alignment) % alignment) !=
+           NULL;
+}
+
+// an int in [0, max]
+static bool readCount(Reader *reader, int max, int *count)
+{
+    int32_t value;
+    if (!readBytes(reader, &value, sizeof(value)) || value < 0 || value > max)
+        return false;
+    *count = value;
+    return true;
+}
+
+static const char *readChars(Reader *reader, int *length)
+{
+    if (!readCount(reader, INT32_MAX, length))
+        return NULL;
+    return (const char *)skipBytes(reader, *length);
+}
+
+// the counterpart of writeFunctionCode, the bytes are only checked when
+// function is NULL
+static bool readFunctionCode(Reader *reader, ObjFunction *function)
+{
+    int arity, upvalueCount, maxStackSize, loopCount;
+    if (!readCount(reader, UINT8_MAX, &arity) ||
+        !readCount(reader, UINT8_COUNT, &upvalueCount) ||
+        !readCount(reader, INT32_MAX, &maxStackSize) ||
+        !readCount(reader, UINT8_COUNT, &loopCount))
+        return false;
+
+    // no copy of the code and lines, they stay in the mapped file
+    int count;
+    uint8_t *code;
+    if (!readCount(reader, INT32_MAX, &count) ||
+        (code = skipBytes(reader, count)) == NULL ||
+        !skipPadding(reader, sizeof(int)) ||
+        !hasBytes(reader, sizeof(int) * (size_t)count))
+        return false;
+    int *lines = (int *)skipBytes(reader, sizeof(int) * count);
+    if (function == NULL)
+        return true;
+
+    function->arity = arity;
+    function->upvalueCount = upvalueCount;
+    function->maxStackSize = maxStackSize;
+    uint32_t *loopCounters = ALLOCATE(uint32_t, loopCount);
+    function->loopCount = loopCount;
+    for (int i = 0; i < loopCount; i++)
+    {
+        loopCounters[i] = 0;
+    }
+    functionState(function)->loopCounters = loopCounters;
+
+    Chunk *chunk = &function->chunk;
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->count = count;
+    chunk->capacity = count;
+    chunk->mapped = true;
+    return true;
+}
+
+// the file is mapped read only, so every process running it shares its pages
+//
+// false if the file cannot be mapped or its header is not the expected one
+static bool mapFile(const char *path, Header expected, Reader *reader)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat status;
+    if (fstat(fd, &status) < 0 || status.st_size < (off_t)sizeof(Header))
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = status.st_size;
+    uint8_t *start = (uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping does not need the descriptor
+    close(fd);
+    if (start == MAP_FAILED)
+        return false;
+
+    *reader = (Reader){start, start, start + size, 0};
+    Header header;
+    readBytes(reader, &header, sizeof(header));
+    expected.bodyHash =
+        hashBytes(FNV_OFFSET, reader->current, reader->end - reader->current);
+    if (memcmp(&header, &expected, sizeof(header)) != 0)
+    {
+        munmap(start, size);
+        return false;
+    }
+    return true;
+}
+
+// a file which was read successfully is unmapped by freeVM, after every
+// function pointing into it is gone
+//
+// objects read before a failure are garbage, their chunks are never used again
+// even though they point into the file, so it is unmapped right away
+static void finishFile(Reader *reader, bool read)
+{
+    if (!read)
+    {
+        munmap(reader->start, reader->end - reader->start);
+        return;
+    }
+    MappedFile *mapped = (MappedFile *)malloc(sizeof(MappedFile));
+    if (mapped == NULL)
+        exit(1);
+    mapped->start = reader->start;
+    mapped->size = reader->end - reader->start;
+    mapped->next = vm->mappedFiles;
+    vm->mappedFiles = mapped;
+}
+
+// bytecode caches
+//
+// body:     the script function
+// function: has name (1 byte), [name], function code, constant count,
+//           constants
+// constant: tag (1 byte) followed by a double, a string or a function
+// string:   length followed by the characters
+
+typedef enum
+{
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} ConstantTag;
+
+// functions nested deeper than this are rejected, every level keeps one value
+// on the VM stack while it is read
+#define MAX_NESTING 64
+
+static void writeFunction(Writer *writer, ObjFunction *function)
+{
+    writeByte(writer, function->name != NULL);
+    if (function->name != NULL)
+        writeChars(writer, function->name->chars, function->name->length);
+    writeFunctionCode(writer, function);
+
+    // the compiler only makes numbers, strings and functions constants
+    Chunk *chunk = &function->chunk;
+    writeInt(writer, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value constant = chunk->constants.values[i];
+        if (IS_NUMBER(constant))
+        {
+            writeByte(writer, CONSTANT_NUMBER);
+            double number = AS_NUMBER(constant);
+            writeBytes(writer, &number, sizeof(number));
+        } else if (IS_STRING(constant))
+        {
+            writeByte(writer, CONSTANT_STRING);
+            writeChars(writer, AS_CSTRING(constant),
+                       AS_STRING(constant)->length);
+        } else
+        {
+            writeByte(writer, CONSTANT_FUNCTION);
+            writeFunction(writer, AS_FUNCTION(constant));
+        }
+    }
+}
+
+static void writeScript(Writer *writer, void *function)
+{
+    writeFunction(writer, (ObjFunction *)function);
+}
+
+bool writeBytecode(const char *path, ObjFunction *function,
+                   const char *source)
+{
+    return writeFile(path, makeHeader("LOXC", source), writeScript, function);
+}
+
+static ObjString *readString(Reader *reader)
+{
+    int length;
+    const char *chars = readChars(reader, &length);
+    return chars != NULL ? copyString(chars, length) : NULL;
+}
+
+static ObjFunction *readFunction(Reader *reader);
+
+static bool readConstant(Reader *reader, Chunk *chunk)
+{
+    uint8_t tag;
+    if (!readBytes(reader, &tag, 1))
+        return false;
+    switch (tag)
+    {
+    case CONSTANT_NUMBER:
+    {
+        double number;
+        if (!readBytes(reader, &number, sizeof(number)))
+            return false;
+        addConstant(chunk, NUMBER_VAL(number));
+        return true;
+    }
+    case CONSTANT_STRING:
+    {
+        ObjString *string = readString(reader);
+        if (string == NULL)
+            return false;
+        addConstant(chunk, OBJ_VAL(string));
+        return true;
+    }
+    case CONSTANT_FUNCTION:
+    {
+        ObjFunction *function = readFunction(reader);
+        if (function == NULL)
+            return false;
+        addConstant(chunk, OBJ_VAL(function));
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// true if the constant operand at offset is within the constants
+static bool checkConstant(Chunk *chunk, int offset)
+{
+    return chunk->code[offset] < chunk->constants.count;
+}
+
+// names of globals, properties and methods are read as strings
+static bool checkName(Chunk *chunk, int offset)
+{
+    return checkConstant(chunk, offset) &&
+           IS_STRING(chunk->constants.values[chunk->code[offset]]);
+}
+
+// the operands run() indexes with are checked once here instead of on every
+// run: constants, upvalues and loop counters must exist and jumps must land
+// inside the code
+//
+// the constants must have been read, a closure's length depends on its
+// function
+static bool checkCode(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    uint8_t *code = chunk->code;
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        // every operand of the longest fixed size instruction is present
+        int left = chunk->count - offset;
+        int length;
+        switch (code[offset])
+        {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_INDEX_GET:
+        case OP_INDEX_SET:
+        case OP_EQUAL_NUMBER:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+            length = 1;
+            break;
+        case OP_CONSTANT:
+            length = 2;
+            if (left < length || !checkConstant(chunk, offset + 1))
+                return false;
+            break;
+        case OP_SET_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_CLASS:
+        case OP_SET_PROPERTY:
+        case OP_GET_PROPERTY:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+        case OP_GET_METHOD:
+        case OP_GET_SUPER_METHOD:
+        case OP_GET_FIELD:
+            length = 2;
+            if (left < length || !checkName(chunk, offset + 1))
+                return false;
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            length = 2;
+            if (left < length || code[offset + 1] >= function->upvalueCount)
+                return false;
+            break;
+        case OP_SET_LOCAL:
+        case OP_GET_LOCAL:
+        case OP_BIND_LOCAL:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_CLOSURE:
+        case OP_BUILD_LIST:
+        case OP_BUILD_MAP:
+            length = 2;
+            break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            length = 3;
+            if (left < length ||
+                ((code[offset + 1] << 8) | code[offset + 2]) > left - length)
+                return false;
+            break;
+        case OP_LOOP:
+            length = 4;
+            if (left < length ||
+                ((code[offset + 1] << 8) | code[offset + 2]) >
+                    offset + length ||
+                code[offset + 3] >= function->loopCount)
+                return false;
+            break;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            length = 3;
+            if (left < length || !checkName(chunk, offset + 1))
+                return false;
+            break;
+        case OP_EQUAL_LK:
+        case OP_GREATER_LK:
+        case OP_LESS_LK:
+        case OP_ADD_LK:
+        case OP_SUBTRACT_LK:
+        case OP_MULTIPLY_LK:
+        case OP_DIVIDE_LK:
+            length = 3;
+            if (left < length || !checkConstant(chunk, offset + 2))
+                return false;
+            break;
+        case OP_INVOKE_LOCAL:
+        case OP_EQUAL_LL:
+        case OP_GREATER_LL:
+        case OP_LESS_LL:
+        case OP_ADD_LL:
+        case OP_SUBTRACT_LL:
+        case OP_MULTIPLY_LL:
+        case OP_DIVIDE_LL:
+            length = 3;
+            break;
+        case OP_CLOSURE:
+        {
+            if (left < 2 || !checkConstant(chunk, offset + 1))
+                return false;
+            Value constant = chunk->constants.values[code[offset + 1]];
+            if (!IS_FUNCTION(constant))
+                return false;
+            length = 2 + 2 * AS_FUNCTION(constant)->upvalueCount;
+            break;
+        }
+        default:
+            return false;
+        }
+        if (left < length)
+            return false;
+        offset += length;
+    }
+    return true;
+}
+
+// the structure of the file is checked, and the operands of the code, which
+// is otherwise trusted since the header ties it to the source it was compiled
+// from and to its own contents
+static bool readFunctionBody(Reader *reader, ObjFunction *function)
+{
+    uint8_t hasName;
+    if (!readBytes(reader, &hasName, 1))
+        return false;
+    if (hasName)
+    {
+        function->name = readString(reader);
+        if (function->name == NULL)
+            return false;
+    }
+    if (!readFunctionCode(reader, function))
+        return false;
+
+    int constantCount;
+    if (!readCount(reader, UINT8_COUNT, &constantCount))
+        return false;
+    for (int i = 0; i < constantCount; i++)
+    {
+        if (!readConstant(reader, &function->chunk))
+            return false;
+    }
+    return checkCode(function);
+}
+
+static ObjFunction *readFunction(Reader *reader)
+{
+    if (reader->depth == MAX_NESTING)
+        return NULL;
+
+    // keep the function safe from GC while its constants are allocated
+    ObjFunction *function = newFunction();
+    push(OBJ_VAL(function));
+    reader->depth++;
+    bool read = readFunctionBody(reader, function);
+    reader->depth--;
+    pop();
+    return read ? function : NULL;
+}
+
+ObjFunction *readBytecode(const char *path, const char *source)
+{
+    Reader reader;
+    if (!mapFile(path, makeHeader("LOXC", source), &reader))
+        return NULL;
+
+    ObjFunction *function = readFunction(&reader);
+    // trailing bytes mean the file is not what we wrote
+    if (reader.current != reader.end)
+        function = NULL;
+    finishFile(&reader, function != NULL);
+    return function;
+}
+
+// heap images
+//
+// body:   object count, the type of every object (1 byte each), objects,
+//         global count, globals (name, value), method name count, method
+//         names
+// object: the fields of the object, a reference to another object is its
+//         index, or -1 for NULL
+// value:  tag (1 byte) followed by a double or an index
+//
+// objects are sorted by type, so the objects needed to create one (the
+// function of a closure, the class of an instance...) always come before it
+
+typedef enum
+{
+    VALUE_NIL,
+    VALUE_FALSE,
+    VALUE_TRUE,
+    VALUE_NUMBER,
+    VALUE_OBJECT,
+} ValueTag;
+
+typedef struct
+{
+    Obj *object;
+    int index;
+} ImageEntry;
+
+typedef struct
+{
+    // in file order
+    Obj **objects;
+    int count;
+    // sorted by address, to find the index of an object
+    ImageEntry *entries;
+} Image;
+
+static int compareTypes(const void *a, const void *b)
+{
+    return (int)(*(Obj *const *)a)->type - (int)(*(Obj *const *)b)->type;
+}
+
+static int compareAddresses(const void *a, const void *b)
+{
+    Obj *first = ((const ImageEntry *)a)->object;
+    Obj *second = ((const ImageEntry *)b)->object;
+    return first < second ? -1 : first > second;
+}
+
+static void writeReference(Writer *writer, Image *image, Obj *object)
+{
+    if (object == NULL)
+    {
+        writeInt(writer, -1);
+        return;
+    }
+    ImageEntry key = {object, 0};
+    ImageEntry *entry =
+        (ImageEntry *)bsearch(&key, image->entries, image->count,
+                              sizeof(ImageEntry), compareAddresses);
+    writeInt(writer, entry->index);
+}
+
+static void writeValue(Writer *writer, Image *image, Value value)
+{
+    if (IS_NIL(value))
+    {
+        writeByte(writer, VALUE_NIL);
+    } else if (IS_BOOL(value))
+    {
+        writeByte(writer, AS_BOOL(value) ? VALUE_TRUE : VALUE_FALSE);
+    } else if (IS_NUMBER(value))
+    {
+        writeByte(writer, VALUE_NUMBER);
+        double number = AS_NUMBER(value);
+        writeBytes(writer, &number, sizeof(number));
+    } else
+    {
+        writeByte(writer, VALUE_OBJECT);
+        writeReference(writer, image, AS_OBJ(value));
+    }
+}
+
+static void writeValues(Writer *writer, Image *image, ValueArray *array)
+{
+    writeInt(writer, array->count);
+    for (int i = 0; i < array->count; i++)
+    {
+        writeValue(writer, image, array->values[i]);
+    }
+}
+
+static void writeEntries(Writer *writer, Image *image, Table *table)
+{
+    writeInt(writer, table->count);
+    Entry *entry;
+    for (int i = 0; (entry = tableNext(table, &i)) != NULL; i++)
+    {
+        writeReference(writer, image, (Obj *)entry->key);
+        writeValue(writer, image, entry->value);
+    }
+}
+
+static void writeObject(Writer *writer, Image *image, Obj *object)
+{
+    switch (object->type)
+    {
+    case OBJ_STRING:
+    {
+        ObjString *string = (ObjString *)object;
+        writeChars(writer, string->chars, string->length);
+        break;
+    }
+    case OBJ_FUNCTION:
+    {
+        // the shared closure and the hotness counters start over
+        ObjFunction *function = (ObjFunction *)object;
+        writeReference(writer, image, (Obj *)function->name);
+        writeFunctionCode(writer, function);
+        writeValues(writer, image, &function->chunk.constants);
+        break;
+    }
+    case OBJ_NATIVE:
+    {
+        writeReference(writer, image, (Obj *)((ObjNative *)object)->name);
+        break;
+    }
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)object;
+        writeReference(writer, image, (Obj *)closure->function);
+        for (int i = 0; i < closure->upvalueCount; i++)
+        {
+            writeReference(writer, image, (Obj *)closure->upvalues[i]);
+        }
+        break;
+    }
+    case OBJ_UPVALUE:
+        // no upvalue is open between scripts
+        writeValue(writer, image, *((ObjUpvalue *)object)->location);
+        break;
+    case OBJ_CLASS:
+    {
+        ObjClass *klass = (ObjClass *)object;
+        writeReference(writer, image, (Obj *)klass->name);
+        writeValues(writer, image, &klass->methods);
+        break;
+    }
+    case OBJ_INSTANCE:
+    {
+        ObjInstance *instance = (ObjInstance *)object;
+        writeReference(writer, image, (Obj *)instance->klass);
+        writeEntries(writer, image, &instance->fields);
+        break;
+    }
+    case OBJ_BOUND_METHOD:
+    {
+        ObjBoundMethod *bound = (ObjBoundMethod *)object;
+        writeValue(writer, image, bound->receiver);
+        writeReference(writer, image, (Obj *)bound->method);
+        break;
+    }
+    case OBJ_LIST:
+        writeValues(writer, image, &((ObjList *)object)->elements);
+        break;
+    case OBJ_MAP:
+    {
+        // keys are rehashed when loaded, objects hash by their address
+        ValueTable *entries = &((ObjMap *)object)->entries;
+        writeInt(writer, entries->count);
+        ValueEntry *entry;
+        for (int i = 0; (entry = valueTableNext(entries, &i)) != NULL; i++)
+        {
+            writeValue(writer, image, entry->key);
+            writeValue(writer, image, entry->value);
+        }
+        break;
+    }
+    }
+}
+
+static void writeImage(Writer *writer, void *data)
+{
+    Image *image = (Image *)data;
+    writeInt(writer, image->count);
+    for (int i = 0; i < image->count; i++)
+    {
+        writeByte(writer, image->objects[i]->type);
+    }
+    for (int i = 0; i < image->count; i++)
+    {
+        writeObject(writer, image, image->objects[i]);
+    }
+
+    writeEntries(writer, image, &vm->globals);
+    writeInt(writer, vm->methodNames.count);
+    for (int i = 0; i < vm->methodNames.count; i++)
+    {
+        writeReference(writer, image, AS_OBJ(vm->methodNames.values[i]));
+    }
+}
+
+bool saveImage(const char *path)
+{
+    // after a collection every object left is reachable, and is written
+    collectGarbage();
+
+    Obj *lists[] = {vm->immortalObjects, vm->objects};
+    Image image;
+    image.count = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        for (Obj *object = lists[i]; object != NULL; object = object->next)
+        {
+            image.count++;
+        }
+    }
+    image.objects = (Obj **)malloc(sizeof(Obj *) * image.count);
+    image.entries = (ImageEntry *)malloc(sizeof(ImageEntry) * image.count);
+    if (image.count > 0 && (image.objects == NULL || image.entries == NULL))
+        exit(1);
+
+    int count = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        for (Obj *object = lists[i]; object != NULL; object = object->next)
+        {
+            image.objects[count++] = object;
+        }
+    }
+    qsort(image.objects, image.count, sizeof(Obj *), compareTypes);
+    for (int i = 0; i < image.count; i++)
+    {
+        image.entries[i] = (ImageEntry){image.objects[i], i};
+    }
+    qsort(image.entries, image.count, sizeof(ImageEntry), compareAddresses);
+
+    bool written =
+        writeFile(path, makeHeader("LOXI", NULL), writeImage, &image);
+    free(image.objects);
+    free(image.entries);
+    return written;
+}
+
+// the objects of the image being loaded, they are GC roots until the load is
+// over since most of them are not reachable from anything else yet
+static _Thread_local Obj **loading = NULL;
+static _Thread_local int loadingCount = 0;
+
+void markImageRoots()
+{
+    for (int i = 0; i < loadingCount; i++)
+    {
+        markObject(loading[i]);
+    }
+}
+
+// the image is read twice: the first pass creates the objects and checks the
+// whole file, the second one fills in the references and only fails on code
+// which does not fit its constants
+typedef struct
+{
+    Reader reader;
+    const uint8_t *types;
+    int count;
+    bool resolve;
+} ImageReader;
+
+// an index into the image, or -1 for NULL when nullable
+static bool readReference(ImageReader *image, bool nullable, int *index)
+{
+    int32_t value;
+    if (!readBytes(&image->reader, &value, sizeof(value)))
+        return false;
+    *index = value;
+    return (nullable && value == -1) || (value >= 0 && value < image->count);
+}
+
+// a reference of the given type
+static bool readTyped(ImageReader *image, ObjType type, bool nullable,
+                      Obj **object)
+{
+    int index;
+    if (!readReference(image, nullable, &index))
+        return false;
+    *object = index < 0 ? NULL : loading[index];
+    return index < 0 || image->types[index] == type;
+}
+
+// a reference of the given type to an object which already exists during the
+// first pass, since it is needed to create the object being read
+static Obj *readCreated(ImageReader *image, ObjType type)
+{
+    Obj *object;
+    if (!readTyped(image, type, false, &object))
+        return NULL;
+    return object;
+}
+
+// the type is -1 for values which are not objects
+static bool readValue(ImageReader *image, Value *value, int *type)
+{
+    uint8_t tag;
+    if (!readBytes(&image->reader, &tag, 1))
+        return false;
+    *type = -1;
+    switch (tag)
+    {
+    case VALUE_NIL:
+        *value = NIL_VAL;
+        return true;
+    case VALUE_FALSE:
+    case VALUE_TRUE:
+        *value = BOOL_VAL(tag == VALUE_TRUE);
+        return true;
+    case VALUE_NUMBER:
+    {
+        double number;
+        if (!readBytes(&image->reader, &number, sizeof(number)))
+            return false;
+        *value = NUMBER_VAL(number);
+        return true;
+    }
+    case VALUE_OBJECT:
+    {
+        int index;
+        if (!readReference(image, false, &index))
+            return false;
+        *type = image->types[index];
+        *value = image->resolve ? OBJ_VAL(loading[index]) : NIL_VAL;
+        // upvalues only ever live inside closures
+        return *type != OBJ_UPVALUE;
+    }
+    default:
+        return false;
+    }
+}
+
+// what the values of an array may be
+typedef enum
+{
+    // numbers, strings or functions
+    VALUES_CONSTANTS,
+    // closures or nil
+    VALUES_METHODS,
+    // anything
+    VALUES_ELEMENTS,
+} ValuesKind;
+
+static bool allowedValue(ValuesKind kind, Value value, int type)
+{
+    switch (kind)
+    {
+    case VALUES_CONSTANTS:
+        return type == -1 ? IS_NUMBER(value)
+                          : type == OBJ_STRING || type == OBJ_FUNCTION;
+    case VALUES_METHODS:
+        return type == -1 ? IS_NIL(value) : type == OBJ_CLOSURE;
+    default:
+        return true;
+    }
+}
+
+static bool readValues(ImageReader *image, ValueArray *array, ValuesKind kind)
+{
+    int count;
+    if (!readCount(&image->reader, INT32_MAX, &count))
+        return false;
+    for (int i = 0; i < count; i++)
+    {
+        Value value;
+        int type;
+        if (!readValue(image, &value, &type))
+            return false;
+        if (!allowedValue(kind, value, type))
+            return false;
+        if (image->resolve)
+            writeValueArray(array, value);
+    }
+    return true;
+}
+
+static bool readEntries(ImageReader *image, Table *table)
+{
+    int count;
+    if (!readCount(&image->reader, INT32_MAX, &count))
+        return false;
+    for (int i = 0; i < count; i++)
+    {
+        Obj *key;
+        Value value;
+        int type;
+        if (!readTyped(image, OBJ_STRING, false, &key) ||
+            !readValue(image, &value, &type))
+            return false;
+        if (image->resolve)
+            tableSet(table, (ObjString *)key, value);
+    }
+    return true;
+}
+
+static bool readMapEntries(ImageReader *image, ValueTable *entries)
+{
+    int count;
+    if (!readCount(&image->reader, INT32_MAX, &count))
+        return false;
+    for (int i = 0; i < count; i++)
+    {
+        Value key, value;
+        int type;
+        if (!readValue(image, &key, &type) || !readValue(image, &value, &type))
+            return false;
+        // a NaN key could never be found
+        if (IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key))
+            return false;
+        if (image->resolve)
+            valueTableSet(entries, key, value);
+    }
+    return true;
+}
+
+static bool readObject(ImageReader *image, int index)
+{
+    Reader *reader = &image->reader;
+    Obj **object = &loading[index];
+    switch (image->types[index])
+    {
+    case OBJ_STRING:
+    {
+        int length;
+        const char *chars = readChars(reader, &length);
+        if (chars == NULL)
+            return false;
+        if (!image->resolve)
+            *object = (Obj *)copyString(chars, length);
+        return true;
+    }
+    case OBJ_FUNCTION:
+    {
+        Obj *name;
+        if (!readTyped(image, OBJ_STRING, true, &name))
+            return false;
+        if (!image->resolve)
+            *object = (Obj *)newFunction();
+        ObjFunction *function = (ObjFunction *)*object;
+        function->name = (ObjString *)name;
+        if (!readFunctionCode(reader, image->resolve ? NULL : function))
+            return false;
+        return readValues(image, &function->chunk.constants,
+                          VALUES_CONSTANTS);
+    }
+    case OBJ_NATIVE:
+    {
+        // natives are the ones this VM defined, found by their name before
+        // the globals of the image replace them
+        ObjString *name = (ObjString *)readCreated(image, OBJ_STRING);
+        if (name == NULL)
+            return false;
+        if (image->resolve)
+            return true;
+        Value native;
+        if (!tableGet(&vm->globals, name, &native) || !IS_NATIVE(native))
+            return false;
+        *object = AS_OBJ(native);
+        return true;
+    }
+    case OBJ_CLOSURE:
+    {
+        ObjFunction *function =
+            (ObjFunction *)readCreated(image, OBJ_FUNCTION);
+        if (function == NULL)
+            return false;
+        if (!image->resolve)
+            *object = (Obj *)newClosure(function);
+        ObjClosure *closure = (ObjClosure *)*object;
+        for (int i = 0; i < function->upvalueCount; i++)
+        {
+            Obj *upvalue;
+            if (!readTyped(image, OBJ_UPVALUE, false, &upvalue))
+                return false;
+            closure->upvalues[i] = (ObjUpvalue *)upvalue;
+        }
+        return true;
+    }
+    case OBJ_UPVALUE:
+    {
+        Value value;
+        int type;
+        if (!readValue(image, &value, &type))
+            return false;
+        if (!image->resolve)
+        {
+            ObjUpvalue *upvalue = newUpvalue(NULL);
+            upvalue->location = &upvalue->closed;
+            *object = (Obj *)upvalue;
+        }
+        ((ObjUpvalue *)*object)->closed = value;
+        return true;
+    }
+    case OBJ_CLASS:
+    {
+        ObjString *name = (ObjString *)readCreated(image, OBJ_STRING);
+        if (name == NULL)
+            return false;
+        if (!image->resolve)
+            *object = (Obj *)newClass(name);
+        return readValues(image, &((ObjClass *)*object)->methods,
+                          VALUES_METHODS);
+    }
+    case OBJ_INSTANCE:
+    {
+        ObjClass *klass = (ObjClass *)readCreated(image, OBJ_CLASS);
+        if (klass == NULL)
+            return false;
+        if (!image->resolve)
+            *object = (Obj *)newInstance(klass);
+        return readEntries(image, &((ObjInstance *)*object)->fields);
+    }
+    case OBJ_BOUND_METHOD:
+    {
+        Value receiver;
+        int type;
+        Obj *method;
+        if (!readValue(image, &receiver, &type) ||
+            !readTyped(image, OBJ_CLOSURE, false, &method))
+            return false;
+        if (!image->resolve)
+            *object = (Obj *)newBoundMethod(NIL_VAL, NULL);
+        ObjBoundMethod *bound = (ObjBoundMethod *)*object;
+        bound->receiver = receiver;
+        bound->method = (ObjClosure *)method;
+        return true;
+    }
+    case OBJ_LIST:
+        if (!image->resolve)
+            *object = (Obj *)newList();
+        return readValues(image, &((ObjList *)*object)->elements,
+                          VALUES_ELEMENTS);
+    case OBJ_MAP:
+        if (!image->resolve)
+            *object = (Obj *)newMap();
+        return readMapEntries(image, &((ObjMap *)*object)->entries);
+    default:
+        return false;
+    }
+}
+
+static bool readImage(ImageReader *image)
+{
+    for (int i = 0; i < image->count; i++)
+    {
+        if (!readObject(image, i))
+            return false;
+    }
+    // the constants of every function are in once all objects are resolved,
+    // and nothing outside the image has been changed yet
+    for (int i = 0; image->resolve && i < image->count; i++)
+    {
+        if (image->types[i] == OBJ_FUNCTION &&
+            !checkCode((ObjFunction *)loading[i]))
+            return false;
+    }
+    if (!readEntries(image, &vm->globals))
+        return false;
+
+    int count;
+    if (!readCount(&image->reader, INT32_MAX, &count))
+        return false;
+    for (int i = 0; i < count; i++)
+    {
+        Obj *name;
+        if (!readTyped(image, OBJ_STRING, false, &name))
+            return false;
+        if (image->resolve)
+        {
+            ((ObjString *)name)->methodSlot = i;
+            writeValueArray(&vm->methodNames, OBJ_VAL(name));
+        }
+    }
+    return image->reader.current == image->reader.end;
+}
+
+bool loadImage(const char *path)
+{
+    // method slots are numbered by the image, so the VM must not have
+    // numbered any yet
+    if (vm->methodNames.count != 0)
+        return false;
+
+    ImageReader image;
+    if (!mapFile(path, makeHeader("LOXI", NULL), &image.reader))
+        return false;
+
+    bool read = readCount(&image.reader, INT32_MAX, &image.count) &&
+                (image.types = skipBytes(&image.reader, image.count)) != NULL;
+    for (int i = 0; read && i < image.count; i++)
+    {
+        read = image.types[i] <= OBJ_MAP;
+    }
+
+    if (read)
+    {
+        loading = (Obj **)calloc(image.count, sizeof(Obj *));
+        if (image.count > 0 && loading == NULL)
+            exit(1);
+        loadingCount = image.count;
+
+        Reader objects = image.reader;
+        image.resolve = false;
+        read = readImage(&image);
+        if (read)
+        {
+            image.reader = objects;
+            image.resolve = true;
+            read = readImage(&image);
+        }
+
+        free(loading);
+        loading = NULL;
+        loadingCount = 0;
+    }
+    finishFile(&image.reader, read);
+    return read;
+}
@@ -0,0 +1,43 @@
+// compiled scripts are cached in .loxc files next to their source, so a script
+// which did not change since the last run is not compiled again
+//
+// the file holds the ObjFunction tree of the script: every chunk with its code,
+// lines and constants, nested functions included (upvalue descriptors are part
+// of the code of OP_CLOSURE)
+//
+// heap images hold the whole state left by a script instead: every reachable
+// object, the globals and the method slots, so another process can start from
+// it without running the script again
+
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "common.h"
+#include "object.h"
+
+// bumped whenever the instruction set or the file layout changes
+#define BYTECODE_VERSION 5
+
+// false if the file could not be written
+bool writeBytecode(const char *path, ObjFunction *function,
+                   const char *source);
+// NULL if there is no cache file, it is malformed or it was compiled from a
+// different source or by a different version
+//
+// the code and lines of the functions point into the file, which stays mapped
+// until freeVM
+ObjFunction *readBytecode(const char *path, const char *source);
+
+// collects garbage first, no script can be running (upvalues must be closed)
+//
+// false if the file could not be written
+bool saveImage(const char *path);
+// must come right after newVM, natives are resolved by name against the ones
+// it defined
+//
+// false if the file is missing or malformed, the globals are unchanged then
+bool loadImage(const char *path);
+// the objects of an image being loaded
+void markImageRoots();
+
+#endif
@@ -11,12 +11,16 @@ void initChunk(Chunk *chunk)
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->mapped = false;
 }
 
 void freeChunk(Chunk *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (!chunk->mapped)
+    {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    }
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -47,3 +51,21 @@ int addConstant(Chunk *chunk, Value value)
     pop();
     return chunk->constants.count - 1;
 }
+
+OpCode genericOp(OpCode op)
+{
+    switch (op)
+    {
+    case OP_EQUAL_NUMBER:
+        return OP_EQUAL;
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+        return OP_ADD;
+    case OP_GET_FIELD:
+        return OP_GET_PROPERTY;
+    case OP_CALL_CLOSURE:
+        return OP_CALL;
+    default:
+        return op;
+    }
+}
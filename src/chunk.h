@@ -31,11 +31,14 @@ typedef enum
     OP_NEGATE,
     OP_PRINT,
     OP_JUMP_IF_FALSE,
+    // the jump is followed by the index of the loop in its function
     OP_LOOP,
     // unconditional jump
     OP_JUMP,
     // function call
     OP_CALL,
+    // call in `return f(...)`, reuses the frame of the caller
+    OP_TAIL_CALL,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
@@ -48,8 +51,122 @@ typedef enum
     OP_INHERIT,
     OP_GET_SUPER,
     OP_SUPER_INVOKE,
+    // a local initialized with a method read keeps the receiver and the
+    // unbound method in two slots, so calling it allocates no bound method
+    OP_GET_METHOD,
+    OP_GET_SUPER_METHOD,
+    OP_BIND_LOCAL,
+    OP_INVOKE_LOCAL,
+    // a list of the elements on top of the stack, the operand counts them
+    OP_BUILD_LIST,
+    // a map of the key value pairs on top of the stack, the operand counts
+    // the pairs
+    OP_BUILD_MAP,
+    OP_INDEX_GET,
+    OP_INDEX_SET,
+    // register forms of OP_EQUAL ... OP_DIVIDE, in the same order, which read
+    // their operands straight from the frame instead of the stack
+    //
+    // _LL takes two local slots, _LK a local slot and a constant
+    OP_EQUAL_LL,
+    OP_GREATER_LL,
+    OP_LESS_LL,
+    OP_ADD_LL,
+    OP_SUBTRACT_LL,
+    OP_MULTIPLY_LL,
+    OP_DIVIDE_LL,
+    OP_EQUAL_LK,
+    OP_GREATER_LK,
+    OP_LESS_LK,
+    OP_ADD_LK,
+    OP_SUBTRACT_LK,
+    OP_MULTIPLY_LK,
+    OP_DIVIDE_LK,
+    // quickened forms, the generic instruction rewrites itself into one of
+    // these once it has seen its operands, and they rewrite themselves back
+    // when that guess turns out wrong
+    OP_EQUAL_NUMBER,
+    OP_ADD_NUMBER,
+    OP_ADD_STRING,
+    OP_GET_FIELD,
+    OP_CALL_CLOSURE,
 } OpCode;
 
+// the register machine, selected with --register-vm, runs a translation of
+// the code above in which every instruction names the frame slots it reads
+// and writes, see compileRegisters
+//
+// in the operands A is the slot written, B, C and D slots read, K a
+// constant, and a slot of the stack code is the register of the same number
+typedef enum
+{
+    REG_MOVE,     // A B
+    REG_CONSTANT, // A K
+    REG_NIL,      // A
+    REG_TRUE,     // A
+    REG_FALSE,    // A
+    REG_GET_UPVALUE, // A upvalue
+    REG_SET_UPVALUE, // upvalue B
+    REG_GET_GLOBAL,  // A K
+    REG_SET_GLOBAL,  // K B
+    REG_DEFINE_GLOBAL, // K B
+    // A B C, in the order of OP_EQUAL ... OP_DIVIDE
+    REG_EQUAL,
+    REG_GREATER,
+    REG_LESS,
+    REG_ADD,
+    REG_SUBTRACT,
+    REG_MULTIPLY,
+    REG_DIVIDE,
+    // A B K, the same with a constant on the right
+    REG_EQUAL_K,
+    REG_GREATER_K,
+    REG_LESS_K,
+    REG_ADD_K,
+    REG_SUBTRACT_K,
+    REG_MULTIPLY_K,
+    REG_DIVIDE_K,
+    REG_NOT,    // A B
+    REG_NEGATE, // A B
+    REG_PRINT,  // B
+    // the jumps end in a 16 bit offset
+    REG_JUMP,
+    REG_JUMP_IF_FALSE, // B
+    REG_LOOP,          // followed by the loop index
+    // a comparison whose result only decides a jump, taken when it is false
+    //
+    // B C, then B K, in the order of REG_EQUAL ... REG_LESS
+    REG_JUMP_UNLESS_EQUAL,
+    REG_JUMP_UNLESS_GREATER,
+    REG_JUMP_UNLESS_LESS,
+    REG_JUMP_UNLESS_EQUAL_K,
+    REG_JUMP_UNLESS_GREATER_K,
+    REG_JUMP_UNLESS_LESS_K,
+    REG_RETURN,        // B
+    REG_CLOSE_UPVALUE, // A
+    REG_CLOSURE,       // A K, then the upvalues as in OP_CLOSURE
+    REG_CLASS,         // A K
+    REG_GET_PROPERTY,  // A B K
+    REG_SET_PROPERTY,  // A B K C, the value is also written to A
+    REG_INDEX_GET,     // A B C
+    REG_INDEX_SET,     // A B C D, the value is also written to A
+    REG_BIND_LOCAL,    // A B
+    // these work like their stack instructions on the values at the top of
+    // the stack, which are the registers from A up
+    REG_CALL,             // A argCount
+    REG_TAIL_CALL,        // A argCount
+    REG_INVOKE,           // A K argCount
+    REG_SUPER_INVOKE,     // A K argCount
+    REG_INVOKE_LOCAL,     // A B argCount
+    REG_METHOD,           // A K
+    REG_INHERIT,          // A
+    REG_GET_SUPER,        // A K
+    REG_GET_METHOD,       // A K
+    REG_GET_SUPER_METHOD, // A K
+    REG_BUILD_LIST,       // A count
+    REG_BUILD_MAP,        // A count
+} RegisterOpCode;
+
 typedef struct
 {
     int count;
@@ -61,11 +178,16 @@ typedef struct
     int *lines;
     /* A dynamic array which will store all the compile time constants */
     ValueArray constants;
+    /* code and lines point into a mapped .loxc file and are not owned */
+    bool mapped;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+// the generic instruction a quickened one was rewritten from, op itself for
+// the others
+OpCode genericOp(OpCode op);
 
 #endif
\ No newline at end of file
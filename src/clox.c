@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clox.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// every entry point makes its VM the current one of the thread, and gives the
+// previous one back before returning, so a native can use another VM
+
+static LoxValue toLox(Value value)
+{
+    LoxValue result;
+    if (IS_NIL(value))
+    {
+        result.type = LOX_NIL;
+    } else if (IS_BOOL(value))
+    {
+        result.type = LOX_BOOL;
+        result.as.boolean = AS_BOOL(value);
+    } else if (IS_NUMBER(value))
+    {
+        result.type = LOX_NUMBER;
+        result.as.number = AS_NUMBER(value);
+    } else
+    {
+        result.type = IS_STRING(value) ? LOX_STRING : LOX_OBJECT;
+        result.as.object = AS_OBJ(value);
+    }
+    return result;
+}
+
+static Value fromLox(LoxValue value)
+{
+    switch (value.type)
+    {
+    case LOX_BOOL:
+        return BOOL_VAL(value.as.boolean);
+    case LOX_NUMBER:
+        return NUMBER_VAL(value.as.number);
+    case LOX_STRING:
+    case LOX_OBJECT:
+        return OBJ_VAL((Obj *)value.as.object);
+    default:
+        return NIL_VAL;
+    }
+}
+
+static LoxResult toResult(InterpretResult result)
+{
+    switch (result)
+    {
+    case INTERPRET_OK:
+        return LOX_OK;
+    case INTERPRET_COMPILE_ERROR:
+        return LOX_COMPILE_ERROR;
+    default:
+        return LOX_RUNTIME_ERROR;
+    }
+}
+
+bool callHostNative(ObjNative *native, int argCount, Value *args,
+                    Value *result)
+{
+    LoxValue hostArgs[UINT8_COUNT];
+    for (int i = 0; i < argCount; i++)
+    {
+        hostArgs[i] = toLox(args[i]);
+    }
+    LoxValue hostResult = loxNil();
+    bool succeeded =
+        native->host(vm, native->data, argCount, hostArgs, &hostResult);
+    *result = fromLox(hostResult);
+    return succeeded;
+}
+
+LoxVM *loxNewVM(void)
+{
+    VM *previous = vm;
+    VM *instance = newVM();
+    vm = previous;
+    return instance;
+}
+
+void loxFreeVM(LoxVM *instance)
+{
+    // freeVM gives the current VM back unless it is the one freed
+    freeVM(instance);
+}
+
+void loxFreezeHeap(LoxVM *instance)
+{
+    VM *previous = vm;
+    vm = instance;
+    freezeHeap();
+    vm = previous;
+}
+
+LoxResult loxInterpret(LoxVM *instance, const char *source)
+{
+    VM *previous = vm;
+    InterpretResult result = interpret(instance, source);
+    vm = previous;
+    return toResult(result);
+}
+
+LoxResult loxCompile(LoxVM *instance, const char *source, LoxHandle **script)
+{
+    VM *previous = vm;
+    vm = instance;
+    ObjFunction *function = compile(source);
+    if (function != NULL)
+        *script = loxPin(instance, toLox(OBJ_VAL(function)));
+    vm = previous;
+    return function != NULL ? LOX_OK : LOX_COMPILE_ERROR;
+}
+
+LoxResult loxRun(LoxVM *instance, LoxHandle *script)
+{
+    VM *previous = vm;
+    InterpretResult result =
+        interpretFunction(instance, AS_FUNCTION(script->value));
+    vm = previous;
+    return toResult(result);
+}
+
+// the callee and the arguments go on the stack like for a call from lox code,
+// so the call runs through the same call() and run()
+static InterpretResult callWithArgs(Value callee, int argCount,
+                                    const LoxValue *args, LoxValue *result)
+{
+    Value values[UINT8_COUNT];
+    for (int i = 0; i < argCount; i++)
+    {
+        values[i] = fromLox(args[i]);
+    }
+    Value value;
+    InterpretResult called = callFromHost(callee, argCount, values, &value);
+    if (called == INTERPRET_OK)
+        *result = toLox(value);
+    return called;
+}
+
+LoxResult loxCall(LoxVM *instance, const char *name, int argCount,
+                  const LoxValue *args, LoxValue *result)
+{
+    if (argCount < 0 || argCount > UINT8_MAX)
+        return LOX_RUNTIME_ERROR;
+
+    VM *previous = vm;
+    vm = instance;
+    InterpretResult called = INTERPRET_RUNTIME_ERROR;
+    Value callee;
+    if (tableGet(&vm->globals, copyString(name, (int)strlen(name)), &callee))
+    {
+        called = callWithArgs(callee, argCount, args, result);
+    } else
+    {
+        runtimeError("Undefined variable '%s'", name);
+    }
+    vm = previous;
+    return toResult(called);
+}
+
+LoxResult loxCallPinned(LoxVM *instance, LoxHandle *function, int argCount,
+                        const LoxValue *args, LoxValue *result)
+{
+    return loxCallValue(instance, toLox(function->value), argCount, args,
+                        result);
+}
+
+LoxResult loxCallValue(LoxVM *instance, LoxValue function, int argCount,
+                       const LoxValue *args, LoxValue *result)
+{
+    if (argCount < 0 || argCount > UINT8_MAX)
+        return LOX_RUNTIME_ERROR;
+
+    VM *previous = vm;
+    vm = instance;
+    InterpretResult called =
+        callWithArgs(fromLox(function), argCount, args, result);
+    vm = previous;
+    return toResult(called);
+}
+
+bool loxGetGlobal(LoxVM *instance, const char *name, LoxValue *value)
+{
+    VM *previous = vm;
+    vm = instance;
+    Value global;
+    bool found =
+        tableGet(&vm->globals, copyString(name, (int)strlen(name)), &global);
+    if (found)
+        *value = toLox(global);
+    vm = previous;
+    return found;
+}
+
+void loxSetGlobal(LoxVM *instance, const char *name, LoxValue value)
+{
+    VM *previous = vm;
+    vm = instance;
+    // the value is safe from GC while the name is allocated
+    push(fromLox(value));
+    ObjString *key = copyString(name, (int)strlen(name));
+    tableSet(&vm->globals, key, vm->stackTop[-1]);
+    pop();
+    vm = previous;
+}
+
+void loxDefineNative(LoxVM *instance, const char *name, LoxNativeFn function,
+                     void *data)
+{
+    VM *previous = vm;
+    vm = instance;
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    ObjNative *native = newNative(AS_STRING(vm->stackTop[-1]), NULL);
+    native->host = function;
+    native->data = data;
+    push(OBJ_VAL(native));
+    tableSet(&vm->globals, AS_STRING(vm->stackTop[-2]), vm->stackTop[-1]);
+    pop();
+    pop();
+    vm = previous;
+}
+
+LoxValue loxNil(void)
+{
+    return toLox(NIL_VAL);
+}
+
+LoxValue loxBool(bool boolean)
+{
+    return toLox(BOOL_VAL(boolean));
+}
+
+LoxValue loxNumber(double number)
+{
+    return toLox(NUMBER_VAL(number));
+}
+
+LoxValue loxString(LoxVM *instance, const char *chars, size_t length)
+{
+    VM *previous = vm;
+    vm = instance;
+    LoxValue string = toLox(OBJ_VAL(copyString(chars, (int)length)));
+    vm = previous;
+    return string;
+}
+
+const char *loxStringChars(LoxValue value)
+{
+    return ((ObjString *)value.as.object)->chars;
+}
+
+size_t loxStringLength(LoxValue value)
+{
+    return ((ObjString *)value.as.object)->length;
+}
+
+// pinning allocates manually, the handles are not lox objects
+LoxHandle *loxPin(LoxVM *instance, LoxValue value)
+{
+    Handle *handle = (Handle *)malloc(sizeof(Handle));
+    if (handle == NULL)
+        exit(1);
+    handle->value = fromLox(value);
+    handle->previous = NULL;
+    handle->next = instance->handles;
+    if (instance->handles != NULL)
+        instance->handles->previous = handle;
+    instance->handles = handle;
+    return handle;
+}
+
+LoxValue loxPinned(LoxHandle *handle)
+{
+    return toLox(handle->value);
+}
+
+void loxUnpin(LoxVM *instance, LoxHandle *handle)
+{
+    if (handle->previous != NULL)
+        handle->previous->next = handle->next;
+    else
+        instance->handles = handle->next;
+    if (handle->next != NULL)
+        handle->next->previous = handle->previous;
+    free(handle);
+}
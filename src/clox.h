@@ -0,0 +1,108 @@
+// the embedding API, everything a host program needs to run lox code without
+// depending on the internals of the interpreter
+//
+// every function takes the VM it works on, and a VM must only be used by one
+// thread at a time
+
+#ifndef clox_clox_h
+#define clox_clox_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct VM LoxVM;
+typedef struct Handle LoxHandle;
+
+typedef enum
+{
+    LOX_OK,
+    LOX_COMPILE_ERROR,
+    LOX_RUNTIME_ERROR,
+} LoxResult;
+
+typedef enum
+{
+    LOX_NIL,
+    LOX_BOOL,
+    LOX_NUMBER,
+    LOX_STRING,
+    // functions, classes, instances... the host can only pass them around
+    LOX_OBJECT,
+} LoxType;
+
+// a copy of a lox value, objects in it are only safe from GC while they are
+// reachable from lox code or pinned
+typedef struct
+{
+    LoxType type;
+    union {
+        bool boolean;
+        double number;
+        void *object;
+    } as;
+} LoxValue;
+
+// returns false for a runtime error, with the message as a string in result
+//
+// a native can call back into lox code, and must return false when that call
+// fails, the error has been reported already
+typedef bool (*LoxNativeFn)(LoxVM *vm, void *data, int argCount,
+                            const LoxValue *args, LoxValue *result);
+
+LoxVM *loxNewVM(void);
+void loxFreeVM(LoxVM *vm);
+
+// make every object the VM holds immortal, after setting it up and before
+// forking, so that collections neither free nor trace them again
+void loxFreezeHeap(LoxVM *vm);
+
+// compile and run a script, its globals stay in the VM
+LoxResult loxInterpret(LoxVM *vm, const char *source);
+// compile a script without running it, it is pinned in *script
+LoxResult loxCompile(LoxVM *vm, const char *source, LoxHandle **script);
+LoxResult loxRun(LoxVM *vm, LoxHandle *script);
+
+// call the global function, bound method, native or class named name, the
+// result is only written on success and a missing global is a runtime error,
+// reported like any other
+LoxResult loxCall(LoxVM *vm, const char *name, int argCount,
+                  const LoxValue *args, LoxValue *result);
+
+// call a function the host looked up once and pinned, without finding the
+// global again on every call
+LoxResult loxCallPinned(LoxVM *vm, LoxHandle *function, int argCount,
+                        const LoxValue *args, LoxValue *result);
+// call a value which is reachable anyway, e.g. a function passed to a native
+LoxResult loxCallValue(LoxVM *vm, LoxValue function, int argCount,
+                       const LoxValue *args, LoxValue *result);
+
+// false when there is no such global
+bool loxGetGlobal(LoxVM *vm, const char *name, LoxValue *value);
+void loxSetGlobal(LoxVM *vm, const char *name, LoxValue value);
+// data is passed back to every call of the native
+void loxDefineNative(LoxVM *vm, const char *name, LoxNativeFn function,
+                     void *data);
+
+LoxValue loxNil(void);
+LoxValue loxBool(bool boolean);
+LoxValue loxNumber(double number);
+// a new string, which is not pinned
+LoxValue loxString(LoxVM *vm, const char *chars, size_t length);
+// the characters of a string value, they are null terminated
+const char *loxStringChars(LoxValue value);
+size_t loxStringLength(LoxValue value);
+
+// keep the value alive until it is unpinned, or the VM is freed
+LoxHandle *loxPin(LoxVM *vm, LoxValue value);
+LoxValue loxPinned(LoxHandle *handle);
+void loxUnpin(LoxVM *vm, LoxHandle *handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -12,10 +12,32 @@
 /* #define DEBUG_STRESS_GC */
 // logs for GC
 /* #define DEBUG_LOG_GC */
+// verify the stack depth computed by the compiler, statically and at runtime
+/* #define DEBUG_CHECK_STACK */
+// logs functions and loops as they get hot
+/* #define DEBUG_LOG_HOT */
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+// count calls and loop iterations per function, for vm->tierUp
+#define HOTNESS_COUNTERS
 // IEEE 754 NaN uses a large number of bits in mantissa which dont carry
 // relevance, so they can be used for improvement
 #define NAN_BOXING
 
+// dispatch the next instruction with a computed goto from the end of each
+// handler, instead of going back through the switch
+//
+// it needs the labels as values extension of gcc and clang, and is off while
+// tracing or checking the stack since those run before every instruction
+#if defined(__GNUC__) && !defined(DEBUG_TRACE_EXECUTION) &&                    \
+    !defined(DEBUG_CHECK_STACK)
+#define THREADED_DISPATCH
+#endif
+
+// compile hot functions to machine code when --jit asks for it, the code
+// relies on the NaN boxed layout of values
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING)
+#define BASELINE_JIT
+#endif
+
 #endif
\ No newline at end of file
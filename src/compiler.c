@@ -55,6 +55,9 @@ typedef struct
     int depth;
     // locals should know of they are acptured by an upvalue
     bool isCaptured;
+    // the local was initialized by a method read, the slot below it holds the
+    // receiver, see varDeclaration
+    bool isBoundMethod;
 } Local;
 
 typedef struct
@@ -83,6 +86,16 @@ typedef struct Compiler
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    // how many expressions are being parsed inside each other, the
+    // initializer of a variable is at depth 1
+    int expressionDepth;
+    // the expression at depth 1 is, so far, a plain `a.b` or `super.b`
+    bool methodRead;
+    // same for OP_CALL, to find calls in tail position
+    int lastCall;
+    // offset where the left operand of the infix expression being compiled
+    // starts
+    int leftOperand;
 } Compiler;
 
 typedef struct ClassCompiler
@@ -91,12 +104,12 @@ typedef struct ClassCompiler
     bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler *current = NULL;
+_Thread_local Parser parser;
+_Thread_local Compiler *current = NULL;
 
 // tis will solve the problem of misuse of 'this' and also help in nesting
 // classes
-ClassCompiler *currentClass = NULL;
+_Thread_local ClassCompiler *currentClass = NULL;
 
 static Chunk *currentChunk() { return &current->function->chunk; }
 
@@ -179,10 +192,234 @@ static void emitReturn()
     emitByte(OP_RETURN);
 }
 
+// how many values the instruction at offset pushes (negative for pops), and
+// its length in bytes
+static int stackEffect(Chunk *chunk, int offset, int *length)
+{
+    uint8_t *code = &chunk->code[offset];
+    *length = 1;
+    switch (code[0])
+    {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        return 1;
+    case OP_NOT:
+    case OP_NEGATE:
+        return 0;
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_EQUAL_NUMBER:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_INHERIT:
+        return -1;
+    case OP_CONSTANT:
+    case OP_GET_UPVALUE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_CLASS:
+    case OP_GET_METHOD:
+    case OP_BIND_LOCAL:
+        *length = 2;
+        return 1;
+    case OP_SET_UPVALUE:
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_PROPERTY:
+    case OP_GET_FIELD:
+    case OP_GET_SUPER_METHOD:
+        *length = 2;
+        return 0;
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_PROPERTY:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+        *length = 2;
+        return -1;
+    case OP_CALL:
+    case OP_CALL_CLOSURE:
+    case OP_TAIL_CALL:
+        *length = 2;
+        return -code[1];
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+        *length = 3;
+        return 0;
+    case OP_LOOP:
+        *length = 4;
+        return 0;
+    case OP_EQUAL_LL:
+    case OP_GREATER_LL:
+    case OP_LESS_LL:
+    case OP_ADD_LL:
+    case OP_SUBTRACT_LL:
+    case OP_MULTIPLY_LL:
+    case OP_DIVIDE_LL:
+    case OP_EQUAL_LK:
+    case OP_GREATER_LK:
+    case OP_LESS_LK:
+    case OP_ADD_LK:
+    case OP_SUBTRACT_LK:
+    case OP_MULTIPLY_LK:
+    case OP_DIVIDE_LK:
+        *length = 3;
+        return 1;
+    case OP_BUILD_LIST:
+        *length = 2;
+        return 1 - code[1];
+    case OP_BUILD_MAP:
+        *length = 2;
+        return 1 - 2 * code[1];
+    case OP_INDEX_GET:
+        return -1;
+    case OP_INDEX_SET:
+        return -2;
+    case OP_INVOKE:
+    case OP_INVOKE_LOCAL:
+        *length = 3;
+        return -code[2];
+    case OP_SUPER_INVOKE:
+        // the superclass is popped as well
+        *length = 3;
+        return -code[2] - 1;
+    case OP_CLOSURE:
+    {
+        ObjFunction *function = AS_FUNCTION(chunk->constants.values[code[1]]);
+        *length = 2 + 2 * function->upvalueCount;
+        return 1;
+    }
+    }
+    return 0; // unreachable
+}
+
+int instructionLength(Chunk *chunk, int offset)
+{
+    int length;
+    stackEffect(chunk, offset, &length);
+    return length;
+}
+
+// record the depth at which offset is reached, true if it was not seen before
+//
+// paths which reach it at different depths leave *consistent false
+static bool reachOffset(int *depths, int offset, int depth, bool *consistent)
+{
+    if (depths[offset] == -1)
+    {
+        depths[offset] = depth;
+        return true;
+    }
+    if (depths[offset] != depth)
+    {
+        *consistent = false;
+#ifdef DEBUG_CHECK_STACK
+        fprintf(stderr, "Stack depth %d and %d meet at offset %d\n",
+                depths[offset], depth, offset);
+#endif
+    }
+    return false;
+}
+
+// walk every path through the bytecode, leaving the stack depth before each
+// reachable offset in depths and -1 at the others
+//
+// the depth starts at the callee and its arguments, so the result counts
+// slots above frame->slots
+static int computeDepths(ObjFunction *function, int *depths, bool *consistent)
+{
+    Chunk *chunk = &function->chunk;
+    int *worklist = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+    {
+        depths[i] = -1;
+    }
+    *consistent = true;
+
+    int maxDepth = function->arity + 1;
+    int pending = 0;
+    reachOffset(depths, 0, maxDepth, consistent);
+    worklist[pending++] = 0;
+
+    while (pending > 0)
+    {
+        int offset = worklist[--pending];
+        int depth = depths[offset];
+        // follow the straight line code until it leaves or joins a path
+        // which has been walked already
+        for (;;)
+        {
+            uint8_t instruction = chunk->code[offset];
+            int length;
+            depth += stackEffect(chunk, offset, &length);
+            if (depth > maxDepth)
+                maxDepth = depth;
+            if (depth < 0)
+            {
+                *consistent = false;
+#ifdef DEBUG_CHECK_STACK
+                fprintf(stderr, "Stack underflow at offset %d\n", offset);
+#endif
+            }
+            int next = offset + length;
+
+            if (instruction == OP_RETURN || next >= chunk->count)
+                break;
+            if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+                instruction == OP_LOOP)
+            {
+                int jump = (chunk->code[offset + 1] << 8) |
+                           chunk->code[offset + 2];
+                int target = instruction == OP_LOOP ? next - jump : next + jump;
+                if (target >= chunk->count)
+                    *consistent = false;
+                else if (reachOffset(depths, target, depth, consistent))
+                    worklist[pending++] = target;
+                if (instruction != OP_JUMP_IF_FALSE)
+                    break;
+            }
+            if (!reachOffset(depths, next, depth, consistent))
+                break;
+            offset = next;
+        }
+    }
+
+    FREE_ARRAY(int, worklist, chunk->count);
+    return maxDepth;
+}
+
+static int computeMaxStackSize(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    int *depths = ALLOCATE(int, chunk->count);
+    bool consistent;
+    int maxDepth = computeDepths(function, depths, &consistent);
+    FREE_ARRAY(int, depths, chunk->count);
+    return maxDepth;
+}
+
 static ObjFunction *endCompiler()
 {
     emitReturn();
     ObjFunction *function = current->function;
+    if (!parser.hadError)
+        function->maxStackSize = computeMaxStackSize(function);
+    // the function is still a compiler root here
+    uint32_t *loopCounters = ALLOCATE(uint32_t, function->loopCount);
+    for (int i = 0; i < function->loopCount; i++)
+    {
+        loopCounters[i] = 0;
+    }
+    functionState(function)->loopCounters = loopCounters;
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError)
     {
@@ -219,6 +456,12 @@ static void parsePrecedence(Precedence precedence)
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    bool outermost = ++current->expressionDepth == 1;
+    int start = currentChunk()->count;
+    // every rule at depth 1 ends what came before it, and only dot() and
+    // super_() say that they are a method read
+    if (outermost)
+        current->methodRead = false;
     prefixRule(canAssign);
 
     // infix expression
@@ -226,51 +469,102 @@ static void parsePrecedence(Precedence precedence)
     {
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
+        current->leftOperand = start;
+        if (outermost)
+            current->methodRead = false;
         infixRule(canAssign);
     }
+    current->expressionDepth--;
     if (canAssign && match(TOKEN_EQUAL))
     {
         error("Invalid assignment target");
     }
 }
 
+// true if the code from start to end is the single instruction op
+static bool singleInstruction(int start, int end, OpCode op)
+{
+    return end - start == 2 && currentChunk()->code[start] == op;
+}
+
+// `a + b` and `a + 1` with a local on the left are emitted as one register
+// instruction in place of the operand loads
+//
+// both operands are a single instruction, so no jump can land between them
+static void emitOperator(OpCode op, int left, int right)
+{
+    Chunk *chunk = currentChunk();
+    if (!vm->registerOperands || !singleInstruction(left, right, OP_GET_LOCAL))
+    {
+        emitByte(op);
+        return;
+    }
+
+    OpCode form;
+    if (singleInstruction(right, chunk->count, OP_GET_LOCAL))
+    {
+        form = OP_EQUAL_LL + (op - OP_EQUAL);
+    } else if (singleInstruction(right, chunk->count, OP_CONSTANT))
+    {
+        form = OP_EQUAL_LK + (op - OP_EQUAL);
+    } else
+    {
+        emitByte(op);
+        return;
+    }
+
+    chunk->code[left] = form;
+    chunk->code[left + 2] = chunk->code[right + 1];
+    chunk->count = left + 3;
+    // errors are reported at the line of the operator
+    for (int i = left; i < chunk->count; i++)
+    {
+        chunk->lines[i] = parser.previous.line;
+    }
+}
+
 static void binary(bool canAssign)
 {
     TokenType operatorType = parser.previous.type;
     ParseRule *rule = getRule(operatorType);
+    int left = current->leftOperand;
+    int right = currentChunk()->count;
     parsePrecedence((Precedence)(rule->precedence + 1));
 
     switch (operatorType)
     {
     case TOKEN_BANG_EQUAL:
-        emitBytes(OP_EQUAL, OP_NOT);
+        emitOperator(OP_EQUAL, left, right);
+        emitByte(OP_NOT);
         break;
     case TOKEN_EQUAL_EQUAL:
-        emitByte(OP_EQUAL);
+        emitOperator(OP_EQUAL, left, right);
         break;
     case TOKEN_GREATER:
-        emitByte(OP_GREATER);
+        emitOperator(OP_GREATER, left, right);
         break;
     case TOKEN_GREATER_EQUAL:
-        emitBytes(OP_LESS, OP_NOT);
+        emitOperator(OP_LESS, left, right);
+        emitByte(OP_NOT);
         break;
     case TOKEN_LESS:
-        emitByte(OP_LESS);
+        emitOperator(OP_LESS, left, right);
         break;
     case TOKEN_LESS_EQUAL:
-        emitBytes(OP_GREATER, OP_NOT);
+        emitOperator(OP_GREATER, left, right);
+        emitByte(OP_NOT);
         break;
     case TOKEN_PLUS:
-        emitByte(OP_ADD);
+        emitOperator(OP_ADD, left, right);
         break;
     case TOKEN_MINUS:
-        emitByte(OP_SUBTRACT);
+        emitOperator(OP_SUBTRACT, left, right);
         break;
     case TOKEN_STAR:
-        emitByte(OP_MULTIPLY);
+        emitOperator(OP_MULTIPLY, left, right);
         break;
     case TOKEN_SLASH:
-        emitByte(OP_DIVIDE);
+        emitOperator(OP_DIVIDE, left, right);
         break;
     default:
         return; // unreachable
@@ -338,6 +632,10 @@ static void initCompiler(Compiler *compiler, FunctionType type)
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->expressionDepth = 0;
+    compiler->methodRead = false;
+    compiler->lastCall = -1;
+    compiler->leftOperand = 0;
     compiler->function = newFunction();
     current = compiler;
 
@@ -353,6 +651,7 @@ static void initCompiler(Compiler *compiler, FunctionType type)
     Local *local = &current->locals[current->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->isBoundMethod = false;
 
     // the first empty slot of methods can be used for storing 'this'
     if (type != TYPE_FUNCTION)
@@ -496,12 +795,42 @@ static int resolveUpvalue(Compiler *compiler, Token *name)
     return -1;
 }
 
+static uint8_t argumentList();
+
+// a bound method local is called with its receiver in place of the callee,
+// and is only turned into a real bound method when read for anything else
+static void boundMethodVariable(uint8_t slot, bool canAssign)
+{
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        expression();
+        emitBytes(OP_SET_LOCAL, slot);
+        // the new value is not a method of the receiver
+        emitByte(OP_NIL);
+        emitBytes(OP_SET_LOCAL, slot - 1);
+        emitByte(OP_POP);
+    } else if (match(TOKEN_LEFT_PAREN))
+    {
+        emitBytes(OP_GET_LOCAL, slot - 1);
+        uint8_t argCount = argumentList();
+        emitBytes(OP_INVOKE_LOCAL, slot);
+        emitByte(argCount);
+    } else
+    {
+        emitBytes(OP_BIND_LOCAL, slot);
+    }
+}
+
 static void namedVariable(Token name, bool canAssign)
 {
     uint8_t getOp, setOp;
 
     int arg = resolveLocal(current, &name);
-    if (arg != -1)
+    if (arg != -1 && current->locals[arg].isBoundMethod)
+    {
+        boundMethodVariable((uint8_t)arg, canAssign);
+        return;
+    } else if (arg != -1)
     {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
@@ -577,6 +906,8 @@ static void call(bool canAssign)
 {
     // we have already compiled the '(' token
     uint8_t argCount = argumentList();
+    if (canAssign)
+        current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
@@ -596,10 +927,65 @@ static void dot(bool canAssign)
         emitByte(argCount);
     } else
     {
+        current->methodRead = current->expressionDepth == 1;
         emitBytes(OP_GET_PROPERTY, name);
     }
 }
 
+static void list(bool canAssign)
+{
+    int count = 0;
+    if (!check(TOKEN_RIGHT_BRACKET))
+    {
+        do
+        {
+            expression();
+            if (count == 255)
+            {
+                error("Can't have more than 255 elements in a list literal");
+            }
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements");
+    emitBytes(OP_BUILD_LIST, (uint8_t)count);
+}
+
+static void map(bool canAssign)
+{
+    int count = 0;
+    if (!check(TOKEN_RIGHT_BRACE))
+    {
+        do
+        {
+            expression();
+            consume(TOKEN_COLON, "Expect ':' after map key");
+            expression();
+            if (count == 255)
+            {
+                error("Can't have more than 255 entries in a map literal");
+            }
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries");
+    emitBytes(OP_BUILD_MAP, (uint8_t)count);
+}
+
+static void index_(bool canAssign)
+{
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index");
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        expression();
+        emitByte(OP_INDEX_SET);
+    } else
+    {
+        emitByte(OP_INDEX_GET);
+    }
+}
+
 static void this_(bool canAssign)
 {
     if (currentClass == NULL)
@@ -642,6 +1028,7 @@ static void super_(bool canAssign)
     } else
     {
         namedVariable(syntheticToken("super"), false);
+        current->methodRead = current->expressionDepth == 1;
         emitBytes(OP_GET_SUPER, name);
     }
 }
@@ -650,8 +1037,11 @@ static void super_(bool canAssign)
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {map, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, index_, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
     [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
@@ -744,6 +1134,7 @@ static void addLocal(Token name)
     // for the edge case
     local->depth = -1;
     local->isCaptured = false;
+    local->isBoundMethod = false;
     local->depth = current->scopeDepth;
 }
 
@@ -800,12 +1191,40 @@ static void defineVariable(uint8_t global)
     emitBytes(OP_DEFINE_GLOBAL, global);
 }
 
+// `var f = a.b;` in a local scope leaves both the receiver and the unbound
+// method on the stack, in a hidden local below `f`
+//
+// only reads of `f` which are not calls create the ObjBoundMethod, so a
+// method which is read once and called locally never allocates
+static void bindMethodLocal()
+{
+    Chunk *chunk = currentChunk();
+    int offset = chunk->count - 2;
+    if (current->scopeDepth == 0 || !current->methodRead ||
+        current->localCount == UINT8_COUNT)
+        return;
+
+    chunk->code[offset] = chunk->code[offset] == OP_GET_PROPERTY
+                              ? OP_GET_METHOD
+                              : OP_GET_SUPER_METHOD;
+
+    // no other local can be declared inside the initializer, so the variable
+    // is still the last one and can move up a slot
+    Local *local = &current->locals[current->localCount - 1];
+    current->locals[current->localCount++] = *local;
+    local->name = syntheticToken("");
+    local->depth = current->scopeDepth;
+    local->isCaptured = false;
+    local[1].isBoundMethod = true;
+}
+
 static void varDeclaration()
 {
     uint8_t global = parseVariable("Expect variable name");
     if (match(TOKEN_EQUAL))
     {
         expression();
+        bindMethodLocal();
     } else
     {
         emitByte(OP_NIL);
@@ -874,12 +1293,18 @@ static void emitLoop(int loopStart)
 {
     emitByte(OP_LOOP);
 
-    int offset = currentChunk()->count - loopStart + 2;
+    int offset = currentChunk()->count - loopStart + 3;
     if (offset > UINT16_MAX)
         error("Loop body too large");
 
     emitByte((offset >> 8) & 0xff);
     emitByte(offset & 0xff);
+
+    // loops past the last index share its counter
+    ObjFunction *function = current->function;
+    if (function->loopCount < UINT8_COUNT)
+        function->loopCount++;
+    emitByte(function->loopCount - 1);
 }
 
 static void whileStatement()
@@ -965,8 +1390,15 @@ static void returnStatement()
         {
             error("Can't return a value from an initializer");
         }
+        current->lastCall = -1;
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value");
+        // `return f(...)`, the OP_RETURN stays for callees which do not get
+        // a frame (natives, classes)
+        if (current->lastCall == currentChunk()->count - 2)
+        {
+            currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
@@ -1031,6 +1463,18 @@ static void function(FunctionType type)
 
     // no need to call endScope() because compiler is ended
     ObjFunction *function = endCompiler();
+
+    // captured bound method locals are read through upvalues as plain values
+    for (int i = 0; i < function->upvalueCount; i++)
+    {
+        if (compiler.upvalues[i].isLocal &&
+            current->locals[compiler.upvalues[i].index].isBoundMethod)
+        {
+            emitBytes(OP_BIND_LOCAL, compiler.upvalues[i].index);
+            emitByte(OP_POP);
+        }
+    }
+
     emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
     // OP_CLOSURE has variable sized encoding
@@ -1174,4 +1618,618 @@ void markCompilerRoots()
         markObject((Obj *)compiler->function);
         compiler = compiler->enclosing;
     }
-}
\ No newline at end of file
+}
+// what a slot of the operand stack holds while it is translated for the
+// register machine: its own register, or a local or a constant which has not
+// been copied there, since most reads can take it from where it already is
+typedef enum
+{
+    SLOT_REGISTER,
+    SLOT_LOCAL,
+    SLOT_CONSTANT,
+} SlotKind;
+
+typedef struct
+{
+    SlotKind kind;
+    uint8_t index;
+} SlotValue;
+
+// a jump whose 16 bit offset is patched once every target has its offset
+typedef struct
+{
+    int operand;
+    int target;
+    bool backward;
+} RegisterJump;
+
+typedef struct
+{
+    Chunk *source;
+    Chunk code;
+    // one past the top is written by the _LL and _LK forms
+    SlotValue slots[UINT8_COUNT + 2];
+    int depth;
+    int line;
+    // the last instruction and the register it writes, when that can be
+    // changed to a local by a following OP_SET_LOCAL, or -1
+    int lastStart;
+    int lastDest;
+    RegisterJump *jumps;
+    int jumpCount;
+    int jumpCapacity;
+} RegisterCompiler;
+
+static void emitRegister(RegisterCompiler *rc, uint8_t byte)
+{
+    writeChunk(&rc->code, byte, rc->line);
+}
+
+static void startRegister(RegisterCompiler *rc, RegisterOpCode op)
+{
+    rc->lastStart = rc->code.count;
+    rc->lastDest = -1;
+    emitRegister(rc, op);
+}
+
+// an instruction writing dest, which a store to a local can retarget
+static void startRetargetable(RegisterCompiler *rc, RegisterOpCode op,
+                              int dest)
+{
+    startRegister(rc, op);
+    emitRegister(rc, dest);
+    rc->lastDest = dest;
+}
+
+// copy the value of the slot at pos into its register
+static void materialize(RegisterCompiler *rc, int pos)
+{
+    SlotValue *slot = &rc->slots[pos];
+    if (slot->kind == SLOT_LOCAL)
+    {
+        startRetargetable(rc, REG_MOVE, pos);
+        emitRegister(rc, slot->index);
+    } else if (slot->kind == SLOT_CONSTANT)
+    {
+        startRetargetable(rc, REG_CONSTANT, pos);
+        emitRegister(rc, slot->index);
+    }
+    slot->kind = SLOT_REGISTER;
+}
+
+static void flushSlots(RegisterCompiler *rc, int from)
+{
+    for (int pos = from; pos < rc->depth; pos++)
+    {
+        materialize(rc, pos);
+    }
+}
+
+// the slots still reading local are copied before it is written, true if
+// there was any
+static bool beforeWrite(RegisterCompiler *rc, int local)
+{
+    bool emitted = false;
+    for (int pos = 0; pos < rc->depth; pos++)
+    {
+        if (rc->slots[pos].kind == SLOT_LOCAL && rc->slots[pos].index == local)
+        {
+            materialize(rc, pos);
+            emitted = true;
+        }
+    }
+    return emitted;
+}
+
+// the register holding the value of the slot at pos
+static uint8_t sourceRegister(RegisterCompiler *rc, int pos)
+{
+    if (rc->slots[pos].kind == SLOT_LOCAL)
+        return rc->slots[pos].index;
+    materialize(rc, pos);
+    return (uint8_t)pos;
+}
+
+// a read of a local, which is the value its slot is still waiting for
+static SlotValue localValue(RegisterCompiler *rc, int local)
+{
+    if (rc->slots[local].kind != SLOT_REGISTER)
+        return rc->slots[local];
+    return (SlotValue){SLOT_LOCAL, (uint8_t)local};
+}
+
+static void emitRegisterJump(RegisterCompiler *rc, int target, bool backward)
+{
+    if (rc->jumpCount == rc->jumpCapacity)
+    {
+        int oldCapacity = rc->jumpCapacity;
+        rc->jumpCapacity = GROW_CAPACITY(oldCapacity);
+        rc->jumps = GROW_ARRAY(RegisterJump, rc->jumps, oldCapacity,
+                               rc->jumpCapacity);
+    }
+    rc->jumps[rc->jumpCount++] =
+        (RegisterJump){rc->code.count, target, backward};
+    emitRegister(rc, 0xff);
+    emitRegister(rc, 0xff);
+}
+
+// the two operands on top of the stack, replaced by the result of op
+static void registerBinary(RegisterCompiler *rc, OpCode op)
+{
+    int dest = rc->depth - 2;
+    uint8_t left = sourceRegister(rc, dest);
+    SlotValue right = rc->slots[dest + 1];
+    RegisterOpCode form = REG_EQUAL + (op - OP_EQUAL);
+    uint8_t operand;
+    if (right.kind == SLOT_CONSTANT)
+    {
+        form = REG_EQUAL_K + (op - OP_EQUAL);
+        operand = right.index;
+    } else
+    {
+        operand = sourceRegister(rc, dest + 1);
+    }
+    startRetargetable(rc, form, dest);
+    emitRegister(rc, left);
+    emitRegister(rc, operand);
+    rc->slots[dest].kind = SLOT_REGISTER;
+    rc->depth--;
+}
+
+// a store to local of the value on top, which the instruction that made the
+// value can often write straight away
+static void registerSetLocal(RegisterCompiler *rc, uint8_t local)
+{
+    int top = rc->depth - 1;
+    SlotValue value = rc->slots[top];
+    if (value.kind == SLOT_LOCAL && value.index == local)
+        return;
+
+    bool retarget = value.kind == SLOT_REGISTER && rc->lastDest == top;
+    int last = rc->lastStart;
+    if (beforeWrite(rc, local))
+        retarget = false;
+    if (retarget)
+    {
+        rc->code.code[last + 1] = local;
+        rc->slots[top] = (SlotValue){SLOT_LOCAL, local};
+    } else if (value.kind == SLOT_CONSTANT)
+    {
+        startRegister(rc, REG_CONSTANT);
+        emitRegister(rc, local);
+        emitRegister(rc, value.index);
+    } else
+    {
+        startRegister(rc, REG_MOVE);
+        emitRegister(rc, local);
+        emitRegister(rc, sourceRegister(rc, top));
+    }
+    rc->slots[local].kind = SLOT_REGISTER;
+    rc->lastDest = -1;
+}
+
+// the condition of an if or a while is popped on both paths, so a comparison
+// computing it can become the jump itself
+static void registerJumpIfFalse(RegisterCompiler *rc, int offset, int target)
+{
+    Chunk *source = rc->source;
+    int top = rc->depth - 1;
+    bool dead = source->code[offset + 3] == OP_POP &&
+                source->code[target] == OP_POP;
+    if (!dead)
+    {
+        flushSlots(rc, 0);
+        startRegister(rc, REG_JUMP_IF_FALSE);
+        emitRegister(rc, top);
+        emitRegisterJump(rc, target, false);
+        return;
+    }
+
+    uint8_t *last = &rc->code.code[rc->lastStart];
+    if (rc->lastDest == top && last[0] >= REG_EQUAL && last[0] <= REG_LESS_K &&
+        (last[0] <= REG_LESS || last[0] >= REG_EQUAL_K))
+    {
+        // the moves made by the flush never write what it reads
+        uint8_t op = last[0], left = last[2], right = last[3];
+        int line = rc->code.lines[rc->lastStart];
+        rc->code.count = rc->lastStart;
+        flushSlots(rc, 0);
+        int saved = rc->line;
+        rc->line = line;
+        startRegister(rc, op <= REG_LESS
+                              ? REG_JUMP_UNLESS_EQUAL + (op - REG_EQUAL)
+                              : REG_JUMP_UNLESS_EQUAL_K + (op - REG_EQUAL_K));
+        emitRegister(rc, left);
+        emitRegister(rc, right);
+        emitRegisterJump(rc, target, false);
+        rc->line = saved;
+        return;
+    }
+
+    rc->depth = top;
+    flushSlots(rc, 0);
+    rc->depth = top + 1;
+    uint8_t condition = sourceRegister(rc, top);
+    startRegister(rc, REG_JUMP_IF_FALSE);
+    emitRegister(rc, condition);
+    emitRegisterJump(rc, target, false);
+}
+
+// instructions which run through the stack of the VM, on registers from base
+// up, need their operands in place
+static void stackForm(RegisterCompiler *rc, RegisterOpCode op, int base)
+{
+    flushSlots(rc, base);
+    startRegister(rc, op);
+    emitRegister(rc, base);
+}
+
+static void translateInstruction(RegisterCompiler *rc, int offset)
+{
+    uint8_t *code = &rc->source->code[offset];
+    int top = rc->depth - 1;
+    switch (code[0])
+    {
+    case OP_CONSTANT:
+        rc->slots[rc->depth++] = (SlotValue){SLOT_CONSTANT, code[1]};
+        break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        startRetargetable(rc, REG_NIL + (code[0] - OP_NIL), rc->depth);
+        rc->slots[rc->depth++].kind = SLOT_REGISTER;
+        break;
+    case OP_POP:
+        rc->depth--;
+        break;
+    case OP_GET_UPVALUE:
+    case OP_GET_GLOBAL:
+        startRetargetable(rc,
+                          code[0] == OP_GET_UPVALUE ? REG_GET_UPVALUE
+                                                    : REG_GET_GLOBAL,
+                          rc->depth);
+        emitRegister(rc, code[1]);
+        rc->slots[rc->depth++].kind = SLOT_REGISTER;
+        break;
+    case OP_SET_UPVALUE:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    {
+        uint8_t value = sourceRegister(rc, top);
+        startRegister(rc, code[0] == OP_SET_UPVALUE ? REG_SET_UPVALUE
+                          : code[0] == OP_SET_GLOBAL ? REG_SET_GLOBAL
+                                                     : REG_DEFINE_GLOBAL);
+        emitRegister(rc, code[1]);
+        emitRegister(rc, value);
+        if (code[0] == OP_DEFINE_GLOBAL)
+            rc->depth--;
+        break;
+    }
+    case OP_GET_LOCAL:
+        rc->slots[rc->depth++] = localValue(rc, code[1]);
+        break;
+    case OP_SET_LOCAL:
+        registerSetLocal(rc, code[1]);
+        break;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+        registerBinary(rc, code[0]);
+        break;
+    case OP_EQUAL_NUMBER:
+        registerBinary(rc, OP_EQUAL);
+        break;
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+        registerBinary(rc, OP_ADD);
+        break;
+    case OP_EQUAL_LL:
+    case OP_GREATER_LL:
+    case OP_LESS_LL:
+    case OP_ADD_LL:
+    case OP_SUBTRACT_LL:
+    case OP_MULTIPLY_LL:
+    case OP_DIVIDE_LL:
+        rc->slots[rc->depth] = localValue(rc, code[1]);
+        rc->slots[rc->depth + 1] = localValue(rc, code[2]);
+        rc->depth += 2;
+        registerBinary(rc, OP_EQUAL + (code[0] - OP_EQUAL_LL));
+        break;
+    case OP_EQUAL_LK:
+    case OP_GREATER_LK:
+    case OP_LESS_LK:
+    case OP_ADD_LK:
+    case OP_SUBTRACT_LK:
+    case OP_MULTIPLY_LK:
+    case OP_DIVIDE_LK:
+        rc->slots[rc->depth] = localValue(rc, code[1]);
+        rc->slots[rc->depth + 1] = (SlotValue){SLOT_CONSTANT, code[2]};
+        rc->depth += 2;
+        registerBinary(rc, OP_EQUAL + (code[0] - OP_EQUAL_LK));
+        break;
+    case OP_NOT:
+    case OP_NEGATE:
+    {
+        uint8_t value = sourceRegister(rc, top);
+        startRetargetable(rc, code[0] == OP_NOT ? REG_NOT : REG_NEGATE, top);
+        emitRegister(rc, value);
+        rc->slots[top].kind = SLOT_REGISTER;
+        break;
+    }
+    case OP_PRINT:
+    case OP_RETURN:
+    {
+        uint8_t value = sourceRegister(rc, top);
+        startRegister(rc, code[0] == OP_PRINT ? REG_PRINT : REG_RETURN);
+        emitRegister(rc, value);
+        rc->depth--;
+        break;
+    }
+    case OP_JUMP:
+    case OP_LOOP:
+    {
+        int jump = (code[1] << 8) | code[2];
+        int next = offset + (code[0] == OP_LOOP ? 4 : 3);
+        flushSlots(rc, 0);
+        startRegister(rc, code[0] == OP_LOOP ? REG_LOOP : REG_JUMP);
+        emitRegisterJump(rc, code[0] == OP_LOOP ? next - jump : next + jump,
+                         code[0] == OP_LOOP);
+        if (code[0] == OP_LOOP)
+            emitRegister(rc, code[3]);
+        break;
+    }
+    case OP_JUMP_IF_FALSE:
+    {
+        int jump = (code[1] << 8) | code[2];
+        registerJumpIfFalse(rc, offset, offset + 3 + jump);
+        break;
+    }
+    case OP_CALL:
+    case OP_CALL_CLOSURE:
+    case OP_TAIL_CALL:
+    {
+        int base = rc->depth - code[1] - 1;
+        flushSlots(rc, 0);
+        startRegister(rc, code[0] == OP_TAIL_CALL ? REG_TAIL_CALL : REG_CALL);
+        emitRegister(rc, base);
+        emitRegister(rc, code[1]);
+        rc->depth = base + 1;
+        break;
+    }
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_INVOKE_LOCAL:
+    {
+        // the superclass is above the arguments
+        int base = rc->depth - code[2] - 1 - (code[0] == OP_SUPER_INVOKE);
+        flushSlots(rc, 0);
+        startRegister(rc, code[0] == OP_INVOKE         ? REG_INVOKE
+                          : code[0] == OP_SUPER_INVOKE ? REG_SUPER_INVOKE
+                                                       : REG_INVOKE_LOCAL);
+        emitRegister(rc, base);
+        emitRegister(rc, code[1]);
+        emitRegister(rc, code[2]);
+        rc->depth = base + 1;
+        break;
+    }
+    case OP_CLOSURE:
+    {
+        ObjFunction *function =
+            AS_FUNCTION(rc->source->constants.values[code[1]]);
+        // captured locals must live in their registers
+        for (int i = 0; i < function->upvalueCount; i++)
+        {
+            if (code[2 + 2 * i])
+                materialize(rc, code[3 + 2 * i]);
+        }
+        startRegister(rc, REG_CLOSURE);
+        emitRegister(rc, rc->depth);
+        for (int i = 1; i < 2 + 2 * function->upvalueCount; i++)
+        {
+            emitRegister(rc, code[i]);
+        }
+        rc->slots[rc->depth++].kind = SLOT_REGISTER;
+        break;
+    }
+    case OP_CLOSE_UPVALUE:
+        materialize(rc, top);
+        startRegister(rc, REG_CLOSE_UPVALUE);
+        emitRegister(rc, top);
+        rc->depth--;
+        break;
+    case OP_CLASS:
+        startRegister(rc, REG_CLASS);
+        emitRegister(rc, rc->depth);
+        emitRegister(rc, code[1]);
+        rc->slots[rc->depth++].kind = SLOT_REGISTER;
+        break;
+    case OP_GET_PROPERTY:
+    case OP_GET_FIELD:
+    {
+        uint8_t instance = sourceRegister(rc, top);
+        startRegister(rc, REG_GET_PROPERTY);
+        emitRegister(rc, top);
+        emitRegister(rc, instance);
+        emitRegister(rc, code[1]);
+        rc->slots[top].kind = SLOT_REGISTER;
+        break;
+    }
+    case OP_SET_PROPERTY:
+    {
+        uint8_t instance = sourceRegister(rc, top - 1);
+        uint8_t value = sourceRegister(rc, top);
+        startRegister(rc, REG_SET_PROPERTY);
+        emitRegister(rc, top - 1);
+        emitRegister(rc, instance);
+        emitRegister(rc, code[1]);
+        emitRegister(rc, value);
+        rc->slots[top - 1].kind = SLOT_REGISTER;
+        rc->depth--;
+        break;
+    }
+    case OP_INDEX_GET:
+    {
+        uint8_t object = sourceRegister(rc, top - 1);
+        uint8_t index = sourceRegister(rc, top);
+        startRetargetable(rc, REG_INDEX_GET, top - 1);
+        emitRegister(rc, object);
+        emitRegister(rc, index);
+        rc->slots[top - 1].kind = SLOT_REGISTER;
+        rc->depth--;
+        break;
+    }
+    case OP_INDEX_SET:
+    {
+        uint8_t object = sourceRegister(rc, top - 2);
+        uint8_t index = sourceRegister(rc, top - 1);
+        uint8_t value = sourceRegister(rc, top);
+        startRegister(rc, REG_INDEX_SET);
+        emitRegister(rc, top - 2);
+        emitRegister(rc, object);
+        emitRegister(rc, index);
+        emitRegister(rc, value);
+        rc->slots[top - 2].kind = SLOT_REGISTER;
+        rc->depth -= 2;
+        break;
+    }
+    case OP_BIND_LOCAL:
+        // both slots of the local are written
+        materialize(rc, code[1] - 1);
+        materialize(rc, code[1]);
+        beforeWrite(rc, code[1] - 1);
+        beforeWrite(rc, code[1]);
+        startRegister(rc, REG_BIND_LOCAL);
+        emitRegister(rc, rc->depth);
+        emitRegister(rc, code[1]);
+        rc->slots[rc->depth++].kind = SLOT_REGISTER;
+        break;
+    case OP_METHOD:
+    case OP_GET_SUPER:
+        stackForm(rc, code[0] == OP_METHOD ? REG_METHOD : REG_GET_SUPER,
+                  top - 1);
+        emitRegister(rc, code[1]);
+        rc->depth--;
+        break;
+    case OP_INHERIT:
+        stackForm(rc, REG_INHERIT, top - 1);
+        rc->depth--;
+        break;
+    case OP_GET_METHOD:
+        stackForm(rc, REG_GET_METHOD, top);
+        emitRegister(rc, code[1]);
+        rc->slots[rc->depth++].kind = SLOT_REGISTER;
+        break;
+    case OP_GET_SUPER_METHOD:
+        stackForm(rc, REG_GET_SUPER_METHOD, top - 1);
+        emitRegister(rc, code[1]);
+        break;
+    case OP_BUILD_LIST:
+    case OP_BUILD_MAP:
+    {
+        int count = code[0] == OP_BUILD_LIST ? code[1] : 2 * code[1];
+        int base = rc->depth - count;
+        stackForm(rc, code[0] == OP_BUILD_LIST ? REG_BUILD_LIST : REG_BUILD_MAP,
+                  base);
+        emitRegister(rc, code[1]);
+        rc->slots[base].kind = SLOT_REGISTER;
+        rc->depth = base + 1;
+        break;
+    }
+    }
+}
+
+bool compileRegisters(ObjFunction *function)
+{
+    Chunk *source = &function->chunk;
+    int *depths = ALLOCATE(int, source->count);
+    int *offsets = ALLOCATE(int, source->count);
+    bool *targets = ALLOCATE(bool, source->count);
+    bool consistent;
+    int maxDepth = computeDepths(function, depths, &consistent);
+    bool ok = consistent && maxDepth <= UINT8_COUNT;
+
+    RegisterCompiler rc;
+    rc.source = source;
+    initChunk(&rc.code);
+    rc.jumps = NULL;
+    rc.jumpCount = 0;
+    rc.jumpCapacity = 0;
+
+    // jump targets start with every slot in its register
+    for (int offset = 0; offset < source->count; offset++)
+    {
+        targets[offset] = false;
+    }
+    for (int offset = 0, length; ok && offset < source->count;
+         offset += length)
+    {
+        stackEffect(source, offset, &length);
+        uint8_t op = source->code[offset];
+        if (depths[offset] == -1 ||
+            (op != OP_JUMP && op != OP_JUMP_IF_FALSE && op != OP_LOOP))
+            continue;
+        int jump = (source->code[offset + 1] << 8) | source->code[offset + 2];
+        targets[op == OP_LOOP ? offset + length - jump
+                              : offset + length + jump] = true;
+    }
+
+    bool fallsThrough = false;
+    for (int offset = 0, length; ok && offset < source->count;
+         offset += length)
+    {
+        stackEffect(source, offset, &length);
+        if (depths[offset] == -1)
+        {
+            fallsThrough = false;
+            continue;
+        }
+        rc.line = source->lines[offset];
+        if (offset == 0 || targets[offset])
+        {
+            if (fallsThrough)
+                flushSlots(&rc, 0);
+            rc.depth = depths[offset];
+            for (int pos = 0; pos < rc.depth; pos++)
+            {
+                rc.slots[pos].kind = SLOT_REGISTER;
+            }
+            rc.lastStart = rc.code.count;
+            rc.lastDest = -1;
+        }
+        offsets[offset] = rc.code.count;
+        translateInstruction(&rc, offset);
+        uint8_t op = source->code[offset];
+        fallsThrough = op != OP_RETURN && op != OP_JUMP && op != OP_LOOP;
+    }
+
+    for (int i = 0; ok && i < rc.jumpCount; i++)
+    {
+        RegisterJump *jump = &rc.jumps[i];
+        int after = jump->operand + 2 + jump->backward;
+        int distance = jump->backward ? after - offsets[jump->target]
+                                      : offsets[jump->target] - after;
+        if (distance < 0 || distance > UINT16_MAX)
+            ok = false;
+        rc.code.code[jump->operand] = (distance >> 8) & 0xff;
+        rc.code.code[jump->operand + 1] = distance & 0xff;
+    }
+
+    FREE_ARRAY(RegisterJump, rc.jumps, rc.jumpCapacity);
+    FREE_ARRAY(int, depths, source->count);
+    FREE_ARRAY(int, offsets, source->count);
+    FREE_ARRAY(bool, targets, source->count);
+    if (!ok)
+    {
+        freeChunk(&rc.code);
+        return false;
+    }
+    functionState(function)->registers = rc.code;
+#ifdef DEBUG_PRINT_CODE
+    disassembleRegisters(function);
+#endif
+    return true;
+}
@@ -6,5 +6,10 @@
 
 ObjFunction *compile(const char *source);
 void markCompilerRoots();
+// the length in bytes of the instruction at offset
+int instructionLength(Chunk *chunk, int offset);
+// translate the function for the register machine into function->registers,
+// false if it does not fit in its 256 registers or 16 bit jumps
+bool compileRegisters(ObjFunction *function);
 
 #endif
\ No newline at end of file
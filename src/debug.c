@@ -2,6 +2,7 @@
 #include "chunk.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 #include <stdio.h>
 
 void disassembleChunk(Chunk *chunk, const char *name)
@@ -46,6 +47,15 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+static int loopInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    printf("%-16s %4d -> %d (loop %d)\n", name, offset, offset + 4 - jump,
+           chunk->code[offset + 3]);
+    return offset + 4;
+}
+
 static int invokeInstruction(const char *name, Chunk *chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
@@ -56,6 +66,33 @@ static int invokeInstruction(const char *name, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+static int registerInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t left = chunk->code[offset + 1];
+    uint8_t right = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, left, right);
+    return offset + 3;
+}
+
+static int registerConstantInstruction(const char *name, Chunk *chunk,
+                                       int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int localInvokeInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    printf("%-16s (%d args) %4d\n", name, argCount, slot);
+    return offset + 3;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
@@ -79,9 +116,11 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_JUMP_IF_FALSE:
         return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:
-        return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        return loopInstruction("OP_LOOP", chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return byteInstruction("OP_TAIL_CALL", chunk, offset);
     case OP_CLOSURE:
     {
         offset++;
@@ -163,8 +202,283 @@ int disassembleInstruction(Chunk *chunk, int offset)
         return constantInstruction("OP_GET_SUPER", chunk, offset);
     case OP_SUPER_INVOKE:
         return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+    case OP_GET_METHOD:
+        return constantInstruction("OP_GET_METHOD", chunk, offset);
+    case OP_GET_SUPER_METHOD:
+        return constantInstruction("OP_GET_SUPER_METHOD", chunk, offset);
+    case OP_BIND_LOCAL:
+        return byteInstruction("OP_BIND_LOCAL", chunk, offset);
+    case OP_INVOKE_LOCAL:
+        return localInvokeInstruction("OP_INVOKE_LOCAL", chunk, offset);
+    case OP_BUILD_LIST:
+        return byteInstruction("OP_BUILD_LIST", chunk, offset);
+    case OP_BUILD_MAP:
+        return byteInstruction("OP_BUILD_MAP", chunk, offset);
+    case OP_INDEX_GET:
+        return simpleInstruction("OP_INDEX_GET", offset);
+    case OP_INDEX_SET:
+        return simpleInstruction("OP_INDEX_SET", offset);
+    case OP_EQUAL_LL:
+        return registerInstruction("OP_EQUAL_LL", chunk, offset);
+    case OP_GREATER_LL:
+        return registerInstruction("OP_GREATER_LL", chunk, offset);
+    case OP_LESS_LL:
+        return registerInstruction("OP_LESS_LL", chunk, offset);
+    case OP_ADD_LL:
+        return registerInstruction("OP_ADD_LL", chunk, offset);
+    case OP_SUBTRACT_LL:
+        return registerInstruction("OP_SUBTRACT_LL", chunk, offset);
+    case OP_MULTIPLY_LL:
+        return registerInstruction("OP_MULTIPLY_LL", chunk, offset);
+    case OP_DIVIDE_LL:
+        return registerInstruction("OP_DIVIDE_LL", chunk, offset);
+    case OP_EQUAL_LK:
+        return registerConstantInstruction("OP_EQUAL_LK", chunk, offset);
+    case OP_GREATER_LK:
+        return registerConstantInstruction("OP_GREATER_LK", chunk, offset);
+    case OP_LESS_LK:
+        return registerConstantInstruction("OP_LESS_LK", chunk, offset);
+    case OP_ADD_LK:
+        return registerConstantInstruction("OP_ADD_LK", chunk, offset);
+    case OP_SUBTRACT_LK:
+        return registerConstantInstruction("OP_SUBTRACT_LK", chunk, offset);
+    case OP_MULTIPLY_LK:
+        return registerConstantInstruction("OP_MULTIPLY_LK", chunk, offset);
+    case OP_DIVIDE_LK:
+        return registerConstantInstruction("OP_DIVIDE_LK", chunk, offset);
+    case OP_EQUAL_NUMBER:
+        return simpleInstruction("OP_EQUAL_NUMBER", offset);
+    case OP_ADD_NUMBER:
+        return simpleInstruction("OP_ADD_NUMBER", offset);
+    case OP_ADD_STRING:
+        return simpleInstruction("OP_ADD_STRING", offset);
+    case OP_GET_FIELD:
+        return constantInstruction("OP_GET_FIELD", chunk, offset);
+    case OP_CALL_CLOSURE:
+        return byteInstruction("OP_CALL_CLOSURE", chunk, offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
     }
-}
\ No newline at end of file
+}
+void disassembleRegisters(ObjFunction *function)
+{
+    printf("== %s (registers) ==\n",
+           function->name != NULL ? function->name->chars : "<script>");
+
+    for (int offset = 0; offset < functionState(function)->registers.count;)
+    {
+        offset = disassembleRegisterInstruction(function, offset);
+    }
+}
+
+// the register instructions print their slot operands as r<n> and their
+// constants as k<n> followed by the value
+static void printConstant(ObjFunction *function, uint8_t constant)
+{
+    printf(" k%d '", constant);
+    printValue(function->chunk.constants.values[constant]);
+    printf("'");
+}
+
+// the operands of the instruction at offset, in the order given by format
+//
+// r is a register, k a constant, b a plain byte, j a 16 bit jump and l the
+// backward jump and index of a loop
+static int operandInstruction(const char *name, const char *format,
+                              ObjFunction *function, int offset)
+{
+    uint8_t *code = &functionState(function)->registers.code[offset];
+    int length = 1;
+    printf("%-24s", name);
+    for (const char *operand = format; *operand != '\0'; operand++)
+    {
+        switch (*operand)
+        {
+        case 'r':
+            printf(" r%d", code[length++]);
+            break;
+        case 'k':
+            printConstant(function, code[length++]);
+            break;
+        case 'b':
+            printf(" %d", code[length++]);
+            break;
+        case 'j':
+        {
+            int jump = (code[length] << 8) | code[length + 1];
+            length += 2;
+            printf(" -> %d", offset + length + jump);
+            break;
+        }
+        case 'l':
+        {
+            int jump = (code[length] << 8) | code[length + 1];
+            length += 3;
+            printf(" -> %d (loop %d)", offset + length - jump,
+                   code[length - 1]);
+            break;
+        }
+        }
+    }
+    printf("\n");
+    return offset + length;
+}
+
+int disassembleRegisterInstruction(ObjFunction *function, int offset)
+{
+    Chunk *chunk = &functionState(function)->registers;
+    printf("%04d ", offset);
+
+    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    {
+        printf("   | ");
+    } else
+    {
+        printf("%4d ", chunk->lines[offset]);
+    }
+
+    uint8_t instruction = chunk->code[offset];
+
+    switch (instruction)
+    {
+    case REG_MOVE:
+        return operandInstruction("REG_MOVE", "rr", function, offset);
+    case REG_CONSTANT:
+        return operandInstruction("REG_CONSTANT", "rk", function, offset);
+    case REG_NIL:
+        return operandInstruction("REG_NIL", "r", function, offset);
+    case REG_TRUE:
+        return operandInstruction("REG_TRUE", "r", function, offset);
+    case REG_FALSE:
+        return operandInstruction("REG_FALSE", "r", function, offset);
+    case REG_GET_UPVALUE:
+        return operandInstruction("REG_GET_UPVALUE", "rb", function, offset);
+    case REG_SET_UPVALUE:
+        return operandInstruction("REG_SET_UPVALUE", "br", function, offset);
+    case REG_GET_GLOBAL:
+        return operandInstruction("REG_GET_GLOBAL", "rk", function, offset);
+    case REG_SET_GLOBAL:
+        return operandInstruction("REG_SET_GLOBAL", "kr", function, offset);
+    case REG_DEFINE_GLOBAL:
+        return operandInstruction("REG_DEFINE_GLOBAL", "kr", function, offset);
+    case REG_EQUAL:
+        return operandInstruction("REG_EQUAL", "rrr", function, offset);
+    case REG_GREATER:
+        return operandInstruction("REG_GREATER", "rrr", function, offset);
+    case REG_LESS:
+        return operandInstruction("REG_LESS", "rrr", function, offset);
+    case REG_ADD:
+        return operandInstruction("REG_ADD", "rrr", function, offset);
+    case REG_SUBTRACT:
+        return operandInstruction("REG_SUBTRACT", "rrr", function, offset);
+    case REG_MULTIPLY:
+        return operandInstruction("REG_MULTIPLY", "rrr", function, offset);
+    case REG_DIVIDE:
+        return operandInstruction("REG_DIVIDE", "rrr", function, offset);
+    case REG_EQUAL_K:
+        return operandInstruction("REG_EQUAL_K", "rrk", function, offset);
+    case REG_GREATER_K:
+        return operandInstruction("REG_GREATER_K", "rrk", function, offset);
+    case REG_LESS_K:
+        return operandInstruction("REG_LESS_K", "rrk", function, offset);
+    case REG_ADD_K:
+        return operandInstruction("REG_ADD_K", "rrk", function, offset);
+    case REG_SUBTRACT_K:
+        return operandInstruction("REG_SUBTRACT_K", "rrk", function, offset);
+    case REG_MULTIPLY_K:
+        return operandInstruction("REG_MULTIPLY_K", "rrk", function, offset);
+    case REG_DIVIDE_K:
+        return operandInstruction("REG_DIVIDE_K", "rrk", function, offset);
+    case REG_NOT:
+        return operandInstruction("REG_NOT", "rr", function, offset);
+    case REG_NEGATE:
+        return operandInstruction("REG_NEGATE", "rr", function, offset);
+    case REG_PRINT:
+        return operandInstruction("REG_PRINT", "r", function, offset);
+    case REG_JUMP:
+        return operandInstruction("REG_JUMP", "j", function, offset);
+    case REG_JUMP_IF_FALSE:
+        return operandInstruction("REG_JUMP_IF_FALSE", "rj", function, offset);
+    case REG_LOOP:
+        return operandInstruction("REG_LOOP", "l", function, offset);
+    case REG_JUMP_UNLESS_EQUAL:
+        return operandInstruction("REG_JUMP_UNLESS_EQUAL", "rrj", function,
+                                  offset);
+    case REG_JUMP_UNLESS_GREATER:
+        return operandInstruction("REG_JUMP_UNLESS_GREATER", "rrj", function,
+                                  offset);
+    case REG_JUMP_UNLESS_LESS:
+        return operandInstruction("REG_JUMP_UNLESS_LESS", "rrj", function,
+                                  offset);
+    case REG_JUMP_UNLESS_EQUAL_K:
+        return operandInstruction("REG_JUMP_UNLESS_EQUAL_K", "rkj", function,
+                                  offset);
+    case REG_JUMP_UNLESS_GREATER_K:
+        return operandInstruction("REG_JUMP_UNLESS_GREATER_K", "rkj",
+                                  function, offset);
+    case REG_JUMP_UNLESS_LESS_K:
+        return operandInstruction("REG_JUMP_UNLESS_LESS_K", "rkj", function,
+                                  offset);
+    case REG_RETURN:
+        return operandInstruction("REG_RETURN", "r", function, offset);
+    case REG_CLOSE_UPVALUE:
+        return operandInstruction("REG_CLOSE_UPVALUE", "r", function, offset);
+    case REG_CLOSURE:
+    {
+        uint8_t constant = chunk->code[offset + 2];
+        offset = operandInstruction("REG_CLOSURE", "rk", function, offset);
+        ObjFunction *closed =
+            AS_FUNCTION(function->chunk.constants.values[constant]);
+        for (int j = 0; j < closed->upvalueCount; j++)
+        {
+            int isLocal = chunk->code[offset++];
+            int index = chunk->code[offset++];
+            printf("%04d      |                     %s %d\n", offset - 2,
+                   isLocal ? "local" : "upvalue", index);
+        }
+        return offset;
+    }
+    case REG_CLASS:
+        return operandInstruction("REG_CLASS", "rk", function, offset);
+    case REG_GET_PROPERTY:
+        return operandInstruction("REG_GET_PROPERTY", "rrk", function, offset);
+    case REG_SET_PROPERTY:
+        return operandInstruction("REG_SET_PROPERTY", "rrkr", function,
+                                  offset);
+    case REG_INDEX_GET:
+        return operandInstruction("REG_INDEX_GET", "rrr", function, offset);
+    case REG_INDEX_SET:
+        return operandInstruction("REG_INDEX_SET", "rrrr", function, offset);
+    case REG_BIND_LOCAL:
+        return operandInstruction("REG_BIND_LOCAL", "rr", function, offset);
+    case REG_CALL:
+        return operandInstruction("REG_CALL", "rb", function, offset);
+    case REG_TAIL_CALL:
+        return operandInstruction("REG_TAIL_CALL", "rb", function, offset);
+    case REG_INVOKE:
+        return operandInstruction("REG_INVOKE", "rkb", function, offset);
+    case REG_SUPER_INVOKE:
+        return operandInstruction("REG_SUPER_INVOKE", "rkb", function, offset);
+    case REG_INVOKE_LOCAL:
+        return operandInstruction("REG_INVOKE_LOCAL", "rrb", function, offset);
+    case REG_METHOD:
+        return operandInstruction("REG_METHOD", "rk", function, offset);
+    case REG_INHERIT:
+        return operandInstruction("REG_INHERIT", "r", function, offset);
+    case REG_GET_SUPER:
+        return operandInstruction("REG_GET_SUPER", "rk", function, offset);
+    case REG_GET_METHOD:
+        return operandInstruction("REG_GET_METHOD", "rk", function, offset);
+    case REG_GET_SUPER_METHOD:
+        return operandInstruction("REG_GET_SUPER_METHOD", "rk", function,
+                                  offset);
+    case REG_BUILD_LIST:
+        return operandInstruction("REG_BUILD_LIST", "rb", function, offset);
+    case REG_BUILD_MAP:
+        return operandInstruction("REG_BUILD_MAP", "rb", function, offset);
+    default:
+        printf("Unknown opcode %d\n", instruction);
+        return offset + 1;
+    }
+}
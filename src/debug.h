@@ -2,8 +2,12 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "object.h"
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+// the translation of function for the register machine
+void disassembleRegisters(ObjFunction *function);
+int disassembleRegisterInstruction(ObjFunction *function, int offset);
 
 #endif
\ No newline at end of file
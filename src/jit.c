@@ -0,0 +1,852 @@
+#include "jit.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+#ifdef BASELINE_JIT
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// the machine code of a function, which can be entered at any of its
+// instructions
+struct JitCode
+{
+    uint8_t *code;
+    size_t size;
+    // where the template of each instruction starts in code, indexed by the
+    // offset of the instruction in the chunk
+    uint32_t *entries;
+};
+
+// the code is called with the VM, the frame and the template to start at
+typedef JitExit (*JitEntry)(VM *instance, CallFrame *frame, uint8_t *target);
+
+typedef enum
+{
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+} Register;
+
+// the registers the code keeps its state in, all of them callee saved, every
+// other register is scratch within a template
+#define SLOTS R12
+#define SP R13
+#define FRAME R14
+#define VM_STATE R15
+// the tag bits of every value which is not a number
+#define TAGS RBX
+
+// opcodes of the op r/m, reg forms
+typedef enum
+{
+    X86_ADD = 0x01,
+    X86_OR = 0x09,
+    X86_AND = 0x21,
+    X86_SUB = 0x29,
+    X86_XOR = 0x31,
+    X86_CMP = 0x39,
+    X86_MOV = 0x89,
+} X86Op;
+
+// the ops with an immediate, as their ModRM extension
+typedef enum
+{
+    IMM_ADD = 0,
+    IMM_SUB = 5,
+} ImmediateOp;
+
+typedef enum
+{
+    CC_EQUAL = 0x4,
+    CC_NOT_EQUAL = 0x5,
+    CC_ABOVE = 0x7,
+    CC_NOT_PARITY = 0xb,
+    // not a condition, the jump is always taken
+    CC_ALWAYS = -1,
+} Condition;
+
+// a jump to an instruction of the chunk, patched once every template is
+// placed
+typedef struct
+{
+    int at;
+    int target;
+} Patch;
+
+typedef struct
+{
+    uint8_t *code;
+    int count;
+    int capacity;
+    Patch *patches;
+    int patchCount;
+    int patchCapacity;
+    // shared exits, each returns its JitExit
+    int errorExit;
+    int frameExit;
+    int interpretExit;
+} Assembler;
+
+#define HELPER(function) ((uint64_t)(uintptr_t)(function))
+
+// the assembler uses plain malloc like the VM stacks, compiling happens in
+// the middle of an instruction where the GC must not run
+static void emitByte(Assembler *a, uint8_t byte)
+{
+    if (a->count == a->capacity)
+    {
+        a->capacity = a->capacity < 256 ? 256 : a->capacity * 2;
+        a->code = (uint8_t *)realloc(a->code, a->capacity);
+        if (a->code == NULL)
+            exit(1);
+    }
+    a->code[a->count++] = byte;
+}
+
+static void emit32(Assembler *a, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        emitByte(a, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+static void emit64(Assembler *a, uint64_t value)
+{
+    emit32(a, (uint32_t)value);
+    emit32(a, (uint32_t)(value >> 32));
+}
+
+// W for 64 bit operands, and the high bits of the two register fields
+static void emitRex(Assembler *a, bool wide, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+    if (rex != 0x40)
+        emitByte(a, rex);
+}
+
+static void emitDirect(Assembler *a, int reg, int rm)
+{
+    emitByte(a, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// [base + disp], rsp and r12 as a base need a SIB byte
+static void emitIndirect(Assembler *a, int reg, int base, int32_t disp)
+{
+    bool small = disp >= INT8_MIN && disp <= INT8_MAX;
+    emitByte(a, (small ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP)
+        emitByte(a, 0x24);
+    if (small)
+        emitByte(a, (uint8_t)disp);
+    else
+        emit32(a, (uint32_t)disp);
+}
+
+static void emitMemory(Assembler *a, uint8_t opcode, int reg, int base,
+                       int32_t disp)
+{
+    emitRex(a, true, reg, base);
+    emitByte(a, opcode);
+    emitIndirect(a, reg, base, disp);
+}
+
+static void emitLoad(Assembler *a, int reg, int base, int32_t disp)
+{
+    emitMemory(a, 0x8b, reg, base, disp);
+}
+
+static void emitStore(Assembler *a, int base, int32_t disp, int reg)
+{
+    emitMemory(a, 0x89, reg, base, disp);
+}
+
+// op dst, src on 64 bit registers
+static void emitRegisters(Assembler *a, X86Op op, int dst, int src)
+{
+    emitRex(a, true, src, dst);
+    emitByte(a, op);
+    emitDirect(a, src, dst);
+}
+
+static void emitImmediate(Assembler *a, ImmediateOp op, int reg,
+                          int32_t value)
+{
+    emitRex(a, true, 0, reg);
+    if (value >= INT8_MIN && value <= INT8_MAX)
+    {
+        emitByte(a, 0x83);
+        emitDirect(a, op, reg);
+        emitByte(a, (uint8_t)value);
+    } else
+    {
+        emitByte(a, 0x81);
+        emitDirect(a, op, reg);
+        emit32(a, (uint32_t)value);
+    }
+}
+
+static void emitMoveImmediate(Assembler *a, int reg, uint64_t value)
+{
+    // a 32 bit move clears the upper half
+    emitRex(a, value > UINT32_MAX, 0, reg);
+    emitByte(a, 0xb8 | (reg & 7));
+    if (value > UINT32_MAX)
+        emit64(a, value);
+    else
+        emit32(a, (uint32_t)value);
+}
+
+static void emitPushRegister(Assembler *a, int reg)
+{
+    emitRex(a, false, 0, reg);
+    emitByte(a, 0x50 | (reg & 7));
+}
+
+static void emitPopRegister(Assembler *a, int reg)
+{
+    emitRex(a, false, 0, reg);
+    emitByte(a, 0x58 | (reg & 7));
+}
+
+// movq xmm, reg
+static void emitToDouble(Assembler *a, int xmm, int reg)
+{
+    emitByte(a, 0x66);
+    emitRex(a, true, xmm, reg);
+    emitByte(a, 0x0f);
+    emitByte(a, 0x6e);
+    emitDirect(a, xmm, reg);
+}
+
+// movq reg, xmm
+static void emitFromDouble(Assembler *a, int reg, int xmm)
+{
+    emitByte(a, 0x66);
+    emitRex(a, true, xmm, reg);
+    emitByte(a, 0x0f);
+    emitByte(a, 0x7e);
+    emitDirect(a, xmm, reg);
+}
+
+// a scalar double instruction on xmm0 ... xmm7
+static void emitDouble(Assembler *a, uint8_t prefix, uint8_t opcode, int dst,
+                       int src)
+{
+    emitByte(a, prefix);
+    emitByte(a, 0x0f);
+    emitByte(a, opcode);
+    emitDirect(a, dst, src);
+}
+
+// setcc on the low byte of rax, rcx or rdx
+static void emitSet(Assembler *a, Condition condition, int reg)
+{
+    emitByte(a, 0x0f);
+    emitByte(a, 0x90 | condition);
+    emitDirect(a, 0, reg);
+}
+
+// returns where the displacement goes
+static int emitJump(Assembler *a, Condition condition)
+{
+    if (condition == CC_ALWAYS)
+    {
+        emitByte(a, 0xe9);
+    } else
+    {
+        emitByte(a, 0x0f);
+        emitByte(a, 0x80 | condition);
+    }
+    emit32(a, 0);
+    return a->count - 4;
+}
+
+static void patchJump(Assembler *a, int at, int target)
+{
+    int32_t displacement = target - (at + 4);
+    memcpy(&a->code[at], &displacement, sizeof(displacement));
+}
+
+static void emitJumpTo(Assembler *a, Condition condition, int target)
+{
+    patchJump(a, emitJump(a, condition), target);
+}
+
+// a jump to the instruction at offset target in the chunk
+static void emitBranch(Assembler *a, Condition condition, int target)
+{
+    if (a->patchCount == a->patchCapacity)
+    {
+        a->patchCapacity = a->patchCapacity < 8 ? 8 : a->patchCapacity * 2;
+        a->patches =
+            (Patch *)realloc(a->patches, sizeof(Patch) * a->patchCapacity);
+        if (a->patches == NULL)
+            exit(1);
+    }
+    a->patches[a->patchCount].at = emitJump(a, condition);
+    a->patches[a->patchCount].target = target;
+    a->patchCount++;
+}
+
+static void emitCall(Assembler *a, uint64_t function)
+{
+    emitMoveImmediate(a, RAX, function);
+    // call rax
+    emitByte(a, 0xff);
+    emitDirect(a, 2, RAX);
+}
+
+static void emitPush(Assembler *a, int reg)
+{
+    emitStore(a, SP, 0, reg);
+    emitImmediate(a, IMM_ADD, SP, sizeof(Value));
+}
+
+// jumps away, with a displacement to patch, when reg holds no number
+static int emitNumberGuard(Assembler *a, int reg)
+{
+    emitRegisters(a, X86_MOV, RCX, reg);
+    emitRegisters(a, X86_AND, RCX, TAGS);
+    emitRegisters(a, X86_CMP, RCX, TAGS);
+    return emitJump(a, CC_EQUAL);
+}
+
+// the lox bool for the flag in al
+static void emitBool(Assembler *a)
+{
+    // movzx eax, al
+    emitByte(a, 0x0f);
+    emitByte(a, 0xb6);
+    emitDirect(a, RAX, RAX);
+    emitMoveImmediate(a, RCX, FALSE_VAL);
+    emitRegisters(a, X86_OR, RAX, RCX);
+}
+
+// where the frame goes on from, and the stack, as run() and the helpers
+// expect them
+static void emitSave(Assembler *a, uint8_t *ip)
+{
+    emitMoveImmediate(a, RAX, (uint64_t)(uintptr_t)ip);
+    emitStore(a, FRAME, offsetof(CallFrame, ip), RAX);
+    emitStore(a, VM_STATE, offsetof(VM, stackTop), SP);
+}
+
+static void emitHelper(Assembler *a, uint8_t *next, uint64_t helper,
+                       uint64_t first, uint64_t second)
+{
+    emitSave(a, next);
+    emitMoveImmediate(a, RDI, first);
+    emitMoveImmediate(a, RSI, second);
+    emitCall(a, helper);
+}
+
+// the helper returned a bool, and pushed or popped
+static void emitCheck(Assembler *a)
+{
+    // test al, al
+    emitByte(a, 0x84);
+    emitDirect(a, RAX, RAX);
+    emitJumpTo(a, CC_EQUAL, a->errorExit);
+    emitLoad(a, SP, VM_STATE, offsetof(VM, stackTop));
+}
+
+// lox code run by a helper may have moved the frames and the stack
+static void emitReloadFrame(Assembler *a)
+{
+    // movsxd rax, [vm + frameCount]
+    emitMemory(a, 0x63, RAX, VM_STATE, offsetof(VM, frameCount));
+    // imul rax, rax, sizeof(CallFrame)
+    emitRex(a, true, RAX, RAX);
+    emitByte(a, 0x69);
+    emitDirect(a, RAX, RAX);
+    emit32(a, sizeof(CallFrame));
+    // add rax, [vm + frames]
+    emitMemory(a, 0x03, RAX, VM_STATE, offsetof(VM, frames));
+    // lea frame, [rax - sizeof(CallFrame)]
+    emitMemory(a, 0x8d, FRAME, RAX, -(int32_t)sizeof(CallFrame));
+    emitLoad(a, SLOTS, FRAME, offsetof(CallFrame, slots));
+    emitLoad(a, SP, VM_STATE, offsetof(VM, stackTop));
+}
+
+// a helper which returned a JitCall
+static void emitCallCheck(Assembler *a)
+{
+    // test eax, eax
+    emitByte(a, 0x85);
+    emitDirect(a, RAX, RAX);
+    emitJumpTo(a, CC_EQUAL, a->errorExit);
+    // cmp eax, CALL_PUSHED
+    emitByte(a, 0x83);
+    emitDirect(a, 7, RAX);
+    emitByte(a, CALL_PUSHED);
+    emitJumpTo(a, CC_EQUAL, a->frameExit);
+    emitReloadFrame(a);
+}
+
+// the number op on rax and rdx into rax
+static void emitNumberOp(Assembler *a, OpCode op)
+{
+    emitToDouble(a, 0, RAX);
+    emitToDouble(a, 1, RDX);
+    switch (op)
+    {
+    case OP_ADD:
+        emitDouble(a, 0xf2, 0x58, 0, 1);
+        break;
+    case OP_SUBTRACT:
+        emitDouble(a, 0xf2, 0x5c, 0, 1);
+        break;
+    case OP_MULTIPLY:
+        emitDouble(a, 0xf2, 0x59, 0, 1);
+        break;
+    case OP_DIVIDE:
+        emitDouble(a, 0xf2, 0x5e, 0, 1);
+        break;
+    case OP_GREATER:
+        // ucomisd leaves an unordered compare below, so NaN is never above
+        emitDouble(a, 0x66, 0x2e, 0, 1);
+        emitSet(a, CC_ABOVE, RAX);
+        emitBool(a);
+        return;
+    case OP_LESS:
+        emitDouble(a, 0x66, 0x2e, 1, 0);
+        emitSet(a, CC_ABOVE, RAX);
+        emitBool(a);
+        return;
+    case OP_EQUAL:
+        // equal and ordered
+        emitDouble(a, 0x66, 0x2e, 0, 1);
+        emitSet(a, CC_EQUAL, RAX);
+        emitSet(a, CC_NOT_PARITY, RCX);
+        // and al, cl
+        emitByte(a, 0x20);
+        emitDirect(a, RCX, RAX);
+        emitBool(a);
+        return;
+    default:
+        return; // unreachable
+    }
+    emitFromDouble(a, RAX, 0);
+}
+
+// the result in rax replaces both operands, or is pushed when they were read
+// from the frame
+static void emitResult(Assembler *a, bool onStack)
+{
+    if (onStack)
+    {
+        emitStore(a, SP, -2 * (int32_t)sizeof(Value), RAX);
+        emitImmediate(a, IMM_SUB, SP, sizeof(Value));
+    } else
+    {
+        emitPush(a, RAX);
+    }
+}
+
+// op on the operands in rax and rdx, numbers are done inline and anything
+// else by the slow path of the interpreter
+static void emitBinary(Assembler *a, OpCode op, bool onStack, uint8_t *next)
+{
+    int left = emitNumberGuard(a, RAX);
+    int right = emitNumberGuard(a, RDX);
+    emitNumberOp(a, op);
+    emitResult(a, onStack);
+    int done = emitJump(a, CC_ALWAYS);
+
+    patchJump(a, left, a->count);
+    patchJump(a, right, a->count);
+    if (op == OP_EQUAL)
+    {
+        // anything but two numbers is equal by its bits
+        emitRegisters(a, X86_CMP, RAX, RDX);
+        emitSet(a, CC_EQUAL, RAX);
+        emitBool(a);
+        emitResult(a, onStack);
+    } else
+    {
+        if (!onStack)
+        {
+            emitPush(a, RAX);
+            emitPush(a, RDX);
+        }
+        emitHelper(a, next, HELPER(jitArithmetic), op, 0);
+        emitCheck(a);
+    }
+    patchJump(a, done, a->count);
+}
+
+// falsey values are nil and false, flags equal when rax holds one
+static void emitFalsey(Assembler *a)
+{
+    emitMoveImmediate(a, RCX, NIL_VAL);
+    emitRegisters(a, X86_CMP, RAX, RCX);
+    int isNil = emitJump(a, CC_EQUAL);
+    emitMoveImmediate(a, RCX, FALSE_VAL);
+    emitRegisters(a, X86_CMP, RAX, RCX);
+    patchJump(a, isNil, a->count);
+}
+
+static void emitPrologue(Assembler *a)
+{
+    emitPushRegister(a, RBX);
+    emitPushRegister(a, RBP);
+    emitPushRegister(a, R12);
+    emitPushRegister(a, R13);
+    emitPushRegister(a, R14);
+    emitPushRegister(a, R15);
+    // keep the C stack 16 byte aligned for the helpers
+    emitImmediate(a, IMM_SUB, RSP, 8);
+    emitRegisters(a, X86_MOV, VM_STATE, RDI);
+    emitRegisters(a, X86_MOV, FRAME, RSI);
+    emitMoveImmediate(a, TAGS, QNAN);
+    emitLoad(a, SLOTS, FRAME, offsetof(CallFrame, slots));
+    emitLoad(a, SP, VM_STATE, offsetof(VM, stackTop));
+    // jmp rdx
+    emitByte(a, 0xff);
+    emitDirect(a, 4, RDX);
+
+    a->errorExit = a->count;
+    emitMoveImmediate(a, RAX, JIT_ERROR);
+    int error = emitJump(a, CC_ALWAYS);
+    a->frameExit = a->count;
+    emitMoveImmediate(a, RAX, JIT_FRAME);
+    int frame = emitJump(a, CC_ALWAYS);
+    a->interpretExit = a->count;
+    emitMoveImmediate(a, RAX, JIT_INTERPRET);
+    patchJump(a, error, a->count);
+    patchJump(a, frame, a->count);
+    emitImmediate(a, IMM_ADD, RSP, 8);
+    emitPopRegister(a, R15);
+    emitPopRegister(a, R14);
+    emitPopRegister(a, R13);
+    emitPopRegister(a, R12);
+    emitPopRegister(a, RBP);
+    emitPopRegister(a, RBX);
+    emitByte(a, 0xc3);
+}
+
+// the string constant named by the operand of the instruction at ip
+static uint64_t operandName(ObjFunction *function, uint8_t *ip)
+{
+    return HELPER(AS_OBJ(function->chunk.constants.values[ip[1]]));
+}
+
+static void compileInstruction(Assembler *a, ObjFunction *function,
+                               int offset, int length)
+{
+    uint8_t *ip = &function->chunk.code[offset];
+    uint8_t *next = ip + length;
+    Value *constants = function->chunk.constants.values;
+    OpCode op = (OpCode)ip[0];
+    switch (op)
+    {
+    case OP_CONSTANT:
+        emitMoveImmediate(a, RAX, constants[ip[1]]);
+        emitPush(a, RAX);
+        break;
+    case OP_NIL:
+        emitMoveImmediate(a, RAX, NIL_VAL);
+        emitPush(a, RAX);
+        break;
+    case OP_TRUE:
+        emitMoveImmediate(a, RAX, TRUE_VAL);
+        emitPush(a, RAX);
+        break;
+    case OP_FALSE:
+        emitMoveImmediate(a, RAX, FALSE_VAL);
+        emitPush(a, RAX);
+        break;
+    case OP_POP:
+        emitImmediate(a, IMM_SUB, SP, sizeof(Value));
+        break;
+    case OP_GET_LOCAL:
+        emitLoad(a, RAX, SLOTS, ip[1] * sizeof(Value));
+        emitPush(a, RAX);
+        break;
+    case OP_SET_LOCAL:
+        emitLoad(a, RAX, SP, -(int32_t)sizeof(Value));
+        emitStore(a, SLOTS, ip[1] * sizeof(Value), RAX);
+        break;
+    case OP_GET_UPVALUE:
+        emitLoad(a, RAX, FRAME, offsetof(CallFrame, closure));
+        emitLoad(a, RAX, RAX, offsetof(ObjClosure, upvalues));
+        emitLoad(a, RAX, RAX, ip[1] * sizeof(ObjUpvalue *));
+        emitLoad(a, RAX, RAX, offsetof(ObjUpvalue, location));
+        emitLoad(a, RAX, RAX, 0);
+        emitPush(a, RAX);
+        break;
+    case OP_SET_UPVALUE:
+        emitHelper(a, next, HELPER(jitSetUpvalue), ip[1], 0);
+        break;
+    case OP_GET_GLOBAL:
+        emitHelper(a, next, HELPER(jitGetGlobal), operandName(function, ip),
+                   0);
+        emitCheck(a);
+        break;
+    case OP_SET_GLOBAL:
+        emitHelper(a, next, HELPER(jitSetGlobal), operandName(function, ip),
+                   0);
+        emitCheck(a);
+        break;
+    case OP_DEFINE_GLOBAL:
+        emitHelper(a, next, HELPER(jitDefineGlobal),
+                   operandName(function, ip), 0);
+        emitLoad(a, SP, VM_STATE, offsetof(VM, stackTop));
+        break;
+    case OP_EQUAL:
+    case OP_EQUAL_NUMBER:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_ADD_NUMBER:
+    case OP_ADD_STRING:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    {
+        // the quickened forms are their generic instruction to the templates
+        OpCode generic = op == OP_EQUAL_NUMBER ? OP_EQUAL
+                         : op == OP_ADD_NUMBER || op == OP_ADD_STRING
+                             ? OP_ADD
+                             : op;
+        emitLoad(a, RAX, SP, -2 * (int32_t)sizeof(Value));
+        emitLoad(a, RDX, SP, -(int32_t)sizeof(Value));
+        emitBinary(a, generic, true, next);
+        break;
+    }
+    case OP_EQUAL_LL:
+    case OP_GREATER_LL:
+    case OP_LESS_LL:
+    case OP_ADD_LL:
+    case OP_SUBTRACT_LL:
+    case OP_MULTIPLY_LL:
+    case OP_DIVIDE_LL:
+        emitLoad(a, RAX, SLOTS, ip[1] * sizeof(Value));
+        emitLoad(a, RDX, SLOTS, ip[2] * sizeof(Value));
+        emitBinary(a, (OpCode)(OP_EQUAL + op - OP_EQUAL_LL), false, next);
+        break;
+    case OP_EQUAL_LK:
+    case OP_GREATER_LK:
+    case OP_LESS_LK:
+    case OP_ADD_LK:
+    case OP_SUBTRACT_LK:
+    case OP_MULTIPLY_LK:
+    case OP_DIVIDE_LK:
+        emitLoad(a, RAX, SLOTS, ip[1] * sizeof(Value));
+        emitMoveImmediate(a, RDX, constants[ip[2]]);
+        emitBinary(a, (OpCode)(OP_EQUAL + op - OP_EQUAL_LK), false, next);
+        break;
+    case OP_NOT:
+        emitLoad(a, RAX, SP, -(int32_t)sizeof(Value));
+        emitFalsey(a);
+        emitSet(a, CC_EQUAL, RAX);
+        emitBool(a);
+        emitStore(a, SP, -(int32_t)sizeof(Value), RAX);
+        break;
+    case OP_NEGATE:
+    {
+        emitLoad(a, RAX, SP, -(int32_t)sizeof(Value));
+        int notNumber = emitNumberGuard(a, RAX);
+        emitMoveImmediate(a, RCX, SIGN_BIT);
+        emitRegisters(a, X86_XOR, RAX, RCX);
+        emitStore(a, SP, -(int32_t)sizeof(Value), RAX);
+        int done = emitJump(a, CC_ALWAYS);
+        patchJump(a, notNumber, a->count);
+        emitHelper(a, next, HELPER(jitArithmetic), OP_NEGATE, 0);
+        emitCheck(a);
+        patchJump(a, done, a->count);
+        break;
+    }
+    case OP_PRINT:
+        emitHelper(a, next, HELPER(jitPrint), 0, 0);
+        emitLoad(a, SP, VM_STATE, offsetof(VM, stackTop));
+        break;
+    case OP_JUMP_IF_FALSE:
+        emitLoad(a, RAX, SP, -(int32_t)sizeof(Value));
+        emitFalsey(a);
+        emitBranch(a, CC_EQUAL, offset + length + (ip[1] << 8 | ip[2]));
+        break;
+    case OP_JUMP:
+        emitBranch(a, CC_ALWAYS, offset + length + (ip[1] << 8 | ip[2]));
+        break;
+    case OP_LOOP:
+    {
+#ifdef HOTNESS_COUNTERS
+        // the same saturating count as run(), so that the other loops of the
+        // function still get hot
+        uint32_t *counter = &functionState(function)->loopCounters[ip[3]];
+        emitMoveImmediate(a, RDX, (uint64_t)(uintptr_t)counter);
+        // mov ecx, [rdx]
+        emitByte(a, 0x8b);
+        emitByte(a, 0x0a);
+        // cmp ecx, -1
+        emitByte(a, 0x83);
+        emitDirect(a, 7, RCX);
+        emitByte(a, 0xff);
+        int saturated = emitJump(a, CC_EQUAL);
+        // inc ecx, mov [rdx], ecx
+        emitByte(a, 0xff);
+        emitDirect(a, 0, RCX);
+        emitByte(a, 0x89);
+        emitByte(a, 0x0a);
+        // cmp ecx, HOT_LOOP_THRESHOLD
+        emitByte(a, 0x81);
+        emitDirect(a, 7, RCX);
+        emit32(a, HOT_LOOP_THRESHOLD);
+        int cold = emitJump(a, CC_NOT_EQUAL);
+        emitHelper(a, next, HELPER(jitHotLoop), HELPER(function), ip[3]);
+        patchJump(a, saturated, a->count);
+        patchJump(a, cold, a->count);
+#endif
+        emitBranch(a, CC_ALWAYS, offset + length - (ip[1] << 8 | ip[2]));
+        break;
+    }
+    case OP_CALL:
+    case OP_CALL_CLOSURE:
+        emitHelper(a, next, HELPER(jitCall), ip[1], 0);
+        emitCallCheck(a);
+        break;
+    case OP_INVOKE:
+        emitHelper(a, next, HELPER(jitInvoke), operandName(function, ip),
+                   ip[2]);
+        emitCallCheck(a);
+        break;
+    case OP_TAIL_CALL:
+        emitHelper(a, next, HELPER(jitTailCall), ip[1], 0);
+        emitCheck(a);
+        emitJumpTo(a, CC_ALWAYS, a->frameExit);
+        break;
+    case OP_RETURN:
+        emitHelper(a, next, HELPER(jitReturn), 0, 0);
+        emitJumpTo(a, CC_ALWAYS, a->frameExit);
+        break;
+    case OP_CLOSE_UPVALUE:
+        emitHelper(a, next, HELPER(jitCloseUpvalue), 0, 0);
+        emitLoad(a, SP, VM_STATE, offsetof(VM, stackTop));
+        break;
+    case OP_GET_PROPERTY:
+    case OP_GET_FIELD:
+        emitHelper(a, next, HELPER(jitGetProperty),
+                   operandName(function, ip), 0);
+        emitCheck(a);
+        break;
+    case OP_SET_PROPERTY:
+        emitHelper(a, next, HELPER(jitSetProperty),
+                   operandName(function, ip), 0);
+        emitCheck(a);
+        break;
+    case OP_INDEX_GET:
+        emitHelper(a, next, HELPER(jitIndexGet), 0, 0);
+        emitCheck(a);
+        break;
+    case OP_INDEX_SET:
+        emitHelper(a, next, HELPER(jitIndexSet), 0, 0);
+        emitCheck(a);
+        break;
+    default:
+        // closures, classes and the rest of the method instructions are left
+        // to run(), which comes back at the next call, return or loop
+        emitSave(a, ip);
+        emitJumpTo(a, CC_ALWAYS, a->interpretExit);
+        break;
+    }
+}
+
+bool jitCompile(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    uint32_t *entries = (uint32_t *)malloc(sizeof(uint32_t) * chunk->count);
+    if (entries == NULL)
+        exit(1);
+    Assembler a = {0};
+    emitPrologue(&a);
+
+    for (int offset = 0; offset < chunk->count;)
+    {
+        int length = instructionLength(chunk, offset);
+        entries[offset] = a.count;
+        for (int i = 1; i < length; i++)
+        {
+            entries[offset + i] = UINT32_MAX;
+        }
+        compileInstruction(&a, function, offset, length);
+        offset += length;
+    }
+    for (int i = 0; i < a.patchCount; i++)
+    {
+        patchJump(&a, a.patches[i].at, entries[a.patches[i].target]);
+    }
+    free(a.patches);
+
+    // written while writable, then only executable
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = ((size_t)a.count + page - 1) / page * page;
+    void *code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+    {
+        free(a.code);
+        free(entries);
+        return false;
+    }
+    memcpy(code, a.code, a.count);
+    free(a.code);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(code, size);
+        free(entries);
+        return false;
+    }
+
+    struct JitCode *native = (struct JitCode *)malloc(sizeof(struct JitCode));
+    if (native == NULL)
+        exit(1);
+    native->code = (uint8_t *)code;
+    native->size = size;
+    native->entries = entries;
+    functionState(function)->native = native;
+    return true;
+}
+
+void jitFree(ObjFunction *function)
+{
+    FunctionState *state = functionState(function);
+    if (state->native == NULL)
+        return;
+    munmap(state->native->code, state->native->size);
+    free(state->native->entries);
+    free(state->native);
+    state->native = NULL;
+}
+
+JitExit jitEnter(CallFrame *frame)
+{
+    ObjFunction *function = frame->closure->function;
+    struct JitCode *native = functionState(function)->native;
+    uint32_t entry = native->entries[frame->ip - function->chunk.code];
+    JitEntry code = (JitEntry)(void *)native->code;
+    return code(vm, frame, native->code + entry);
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "chunk.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef BASELINE_JIT
+
+// why the machine code of a frame gave control back to run()
+typedef enum
+{
+    // the instruction at frame->ip is one the code leaves to run()
+    JIT_INTERPRET,
+    // a call pushed a frame or a return popped one, the top frame runs next
+    JIT_FRAME,
+    // a runtime error has been reported
+    JIT_ERROR,
+} JitExit;
+
+// what a call made from machine code left to do
+typedef enum
+{
+    CALL_FAILED,
+    // a native or a class without an initializer, its result is on the stack
+    CALL_DONE,
+    // the callee runs in a frame of its own
+    CALL_PUSHED,
+} JitCall;
+
+// translate the stack code of the function to machine code, one template per
+// instruction, false when there is no executable memory for it
+bool jitCompile(ObjFunction *function);
+void jitFree(ObjFunction *function);
+// run the machine code of the frame from the instruction at frame->ip, with
+// vm->stackTop as its stack
+JitExit jitEnter(CallFrame *frame);
+
+// the slow paths of the machine code, in vm.c
+//
+// the code saves frame->ip and vm->stackTop before calling them, they work on
+// the stack of the VM and return false after reporting an error
+bool jitGetGlobal(ObjString *name);
+bool jitSetGlobal(ObjString *name);
+void jitDefineGlobal(ObjString *name);
+void jitSetUpvalue(int slot);
+void jitPrint();
+// op had an operand which is not a number
+bool jitArithmetic(OpCode op);
+JitCall jitCall(int argCount);
+JitCall jitInvoke(ObjString *name, int argCount);
+bool jitTailCall(int argCount);
+void jitReturn();
+void jitCloseUpvalue();
+bool jitGetProperty(ObjString *name);
+bool jitSetProperty(ObjString *name);
+bool jitIndexGet();
+bool jitIndexSet();
+void jitHotLoop(ObjFunction *function, int loop);
+
+#endif
+
+#endif
@@ -1,13 +1,16 @@
+#include "bytecode.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static void repl()
+static void repl(VM *instance)
 {
     char line[1024];
     for (;;)
@@ -18,7 +21,7 @@ static void repl()
             printf("\n");
             break;
         }
-        interpret(line);
+        interpret(instance, line);
     }
 }
 
@@ -61,34 +64,122 @@ static char *readFile(const char *path)
     return buffer;
 }
 
-static void runFile(const char *path)
+// `script.lox` is cached in `script.loxc`
+static char *cachePath(const char *path)
+{
+    size_t length = strlen(path);
+    const char *suffix =
+        length > 4 && strcmp(path + length - 4, ".lox") == 0 ? "c" : ".loxc";
+    char *cache = (char *)malloc(length + strlen(suffix) + 1);
+    if (cache == NULL)
+    {
+        fprintf(stderr, "Not enough memory to read \"%s\"\n", path);
+        exit(74);
+    }
+    strcpy(cache, path);
+    strcat(cache, suffix);
+    return cache;
+}
+
+static void runFile(VM *instance, const char *path, bool compileOnly)
 {
     char *source = readFile(path);
-    InterpretResult result = interpret(source);
+    char *cache = cachePath(path);
+    // the cache holds code compiled with the default options only
+    bool useCache = instance->registerOperands;
+
+    // a cache which cannot be read or written only costs a compile
+    ObjFunction *function = NULL;
+    if (useCache && !compileOnly)
+        function = readBytecode(cache, source);
+    if (function == NULL)
+    {
+        function = compile(source);
+        if (function == NULL)
+            exit(65);
+        if (useCache && !writeBytecode(cache, function, source) && compileOnly)
+        {
+            fprintf(stderr, "Could not write \"%s\".\n", cache);
+            exit(74);
+        }
+    }
+    free(cache);
     free(source);
+    if (compileOnly)
+        return;
 
-    if (result == INTERPRET_COMPILE_ERROR)
-        exit(65);
+    InterpretResult result = interpretFunction(instance, function);
     if (result == INTERPRET_RUNTIME_ERROR)
         exit(70);
 }
 
 int main(int argc, const char *argv[])
 {
-    initVM();
+    VM *instance = newVM();
 
-    if (argc == 1)
+    // options come before the path
+    bool compileOnly = false;
+    const char *saveImagePath = NULL;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++)
     {
-        repl();
-    } else if (argc == 2)
+        if (strcmp(argv[arg], "--no-register-ops") == 0)
+        {
+            instance->registerOperands = false;
+        } else if (strcmp(argv[arg], "--register-vm") == 0)
+        {
+            instance->registerMachine = true;
+        } else if (strcmp(argv[arg], "--jit") == 0)
+        {
+            // everything is interpreted on machines without a backend
+#ifdef BASELINE_JIT
+            enableJit(instance);
+#endif
+        } else if (strcmp(argv[arg], "--compile-only") == 0)
+        {
+            compileOnly = true;
+        } else if (strcmp(argv[arg], "--save-image") == 0 && arg + 1 < argc)
+        {
+            saveImagePath = argv[++arg];
+        } else if (strcmp(argv[arg], "--load-image") == 0 && arg + 1 < argc)
+        {
+            const char *image = argv[++arg];
+            if (!loadImage(image))
+            {
+                fprintf(stderr, "Could not load image \"%s\".\n", image);
+                exit(74);
+            }
+        } else if (strcmp(argv[arg], "--freeze") == 0)
+        {
+            // whatever the options before it loaded stays for good
+            freezeHeap();
+        } else
+        {
+            break;
+        }
+    }
+
+    if (arg == argc && !compileOnly)
     {
-        runFile(argv[1]);
+        repl(instance);
+    } else if (arg == argc - 1)
+    {
+        runFile(instance, argv[arg], compileOnly);
     } else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--no-register-ops] [--register-vm] "
+                        "[--jit] [--compile-only] [--load-image image] "
+                        "[--freeze] [--save-image image] [path]\n");
         exit(64);
     }
 
-    freeVM();
+    // the state the script or the session ended with
+    if (saveImagePath != NULL && !saveImage(saveImagePath))
+    {
+        fprintf(stderr, "Could not write image \"%s\".\n", saveImagePath);
+        exit(74);
+    }
+
+    freeVM(instance);
     return 0;
 }
\ No newline at end of file
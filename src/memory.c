@@ -1,5 +1,7 @@
 #include "memory.h"
+#include "bytecode.h"
 #include "compiler.h"
+#include "jit.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -17,14 +19,14 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
 {
 
     // keep track of bytes allocated for GC
-    vm.bytesAllocated += newSize - oldSize;
+    vm->bytesAllocated += newSize - oldSize;
 
     if (newSize > oldSize)
     {
 #ifdef DEBUG_STRESS_GC
         collectGarbage();
 #endif
-        if (vm.bytesAllocated > vm.nextGC)
+        if (vm->bytesAllocated > vm->nextGC)
         {
             collectGarbage();
         }
@@ -42,35 +44,98 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
     return result;
 }
 
+// allocated manually like the gray stack, GC must not run in the middle of
+// making an object
+uint32_t allocateId()
+{
+    if (vm->freeIdCount > 0)
+        return vm->freeIds[--vm->freeIdCount];
+
+    if (vm->idCount == vm->idCapacity)
+    {
+        vm->idCapacity = GROW_CAPACITY(vm->idCapacity);
+        vm->marks = (uint8_t *)realloc(vm->marks, vm->idCapacity);
+        if (vm->marks == NULL)
+            exit(1);
+    }
+    vm->marks[vm->idCount] = 0;
+    return vm->idCount++;
+}
+
+// grown like the marks, but only as far as the highest id a function got,
+// which is usually one made by the compiler before anything runs
+void initFunctionState(ObjFunction *function)
+{
+    uint32_t id = function->obj.id;
+    if (id >= vm->functionStateCapacity)
+    {
+        uint32_t capacity = vm->functionStateCapacity;
+        while (capacity <= id)
+            capacity = GROW_CAPACITY(capacity);
+        vm->functionStates = (FunctionState *)realloc(
+            vm->functionStates, sizeof(FunctionState) * capacity);
+        if (vm->functionStates == NULL)
+            exit(1);
+        vm->functionStateCapacity = capacity;
+    }
+
+    FunctionState *state = &vm->functionStates[id];
+    state->callCount = 0;
+    state->loopCounters = NULL;
+    state->closure = NULL;
+    initChunk(&state->registers);
+    state->stackOnly = false;
+    state->native = NULL;
+}
+
+static void freeId(uint32_t id)
+{
+    if (vm->freeIdCount == vm->freeIdCapacity)
+    {
+        vm->freeIdCapacity = GROW_CAPACITY(vm->freeIdCapacity);
+        vm->freeIds = (uint32_t *)realloc(vm->freeIds,
+                                         sizeof(uint32_t) * vm->freeIdCapacity);
+        if (vm->freeIds == NULL)
+            exit(1);
+    }
+    vm->freeIds[vm->freeIdCount++] = id;
+}
+
+bool isMarked(Obj *object)
+{
+    return vm->marks[object->id] != 0;
+}
+
 void markObject(Obj *object)
 {
     if (object == NULL)
         return;
-    // don't add already gray object to avoid indefinite cycles
-    if (object->isMarked)
+    // don't add already gray object to avoid indefinite cycles, immortal
+    // objects are never traced through
+    if (vm->marks[object->id] & (MARKED | IMMORTAL))
         return;
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void *)object);
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
-    object->isMarked = true;
+    vm->marks[object->id] |= MARKED;
 
     // add all gray objects to worklist
-    if (vm.grayCapacity < vm.grayCount + 1)
+    if (vm->grayCapacity < vm->grayCount + 1)
     {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
         // reallocate manually beacuse we dont want GC to collect this dynamic
         // memory
-        vm.grayStack =
-            (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+        vm->grayStack =
+            (Obj **)realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
 
         // we are directly aborting if GC can't allocate
-        if (vm.grayStack == NULL)
+        if (vm->grayStack == NULL)
             exit(1);
     }
 
-    vm.grayStack[vm.grayCount++] = object;
+    vm->grayStack[vm->grayCount++] = object;
 }
 
 void markValue(Value value)
@@ -97,7 +162,13 @@ static void freeObject(Obj *object)
     case OBJ_FUNCTION:
     {
         ObjFunction *function = (ObjFunction *)object;
+        FunctionState *state = functionState(function);
         freeChunk(&function->chunk);
+        freeChunk(&state->registers);
+#ifdef BASELINE_JIT
+        jitFree(function);
+#endif
+        FREE_ARRAY(uint32_t, state->loopCounters, function->loopCount);
         FREE(ObjFunction, object);
         break;
     }
@@ -124,7 +195,7 @@ static void freeObject(Obj *object)
     case OBJ_CLASS:
     {
         ObjClass *klass = (ObjClass *)object;
-        freeTable(&klass->methods);
+        freeValueArray(&klass->methods);
         FREE(ObjClass, object);
         break;
     }
@@ -140,45 +211,102 @@ static void freeObject(Obj *object)
     case OBJ_BOUND_METHOD:
         FREE(ObjBoundMethod, object);
         break;
+    case OBJ_LIST:
+        freeValueArray(&((ObjList *)object)->elements);
+        FREE(ObjList, object);
+        break;
+    case OBJ_MAP:
+        freeValueTable(&((ObjMap *)object)->entries);
+        FREE(ObjMap, object);
+        break;
+    }
+}
+
+static void markArray(ValueArray *array)
+{
+    for (int i = 0; i < array->count; i++)
+    {
+        markValue(array->values[i]);
+    }
+}
+
+// allocated manually like the gray stack, it grows while the VM runs
+void rememberObject(Obj *object)
+{
+    if (vm->rememberedCount == vm->rememberedCapacity)
+    {
+        vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+        vm->remembered = (Obj **)realloc(
+            vm->remembered, sizeof(Obj *) * vm->rememberedCapacity);
+        if (vm->remembered == NULL)
+            exit(1);
     }
+    vm->marks[object->id] |= REMEMBERED;
+    vm->remembered[vm->rememberedCount++] = object;
 }
 
+static void blackenObject(Obj *object);
+
 // mark the root values which are always accessible
 static void markRoots()
 {
-    // values in stack
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+    // values in stack and the open upvalues pointing at them
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
     {
         markValue(*slot);
+        markObject((Obj *)vm->openUpvalues[slot - vm->stack]);
     }
-
-    // call stacks
-    for (int i = 0; i < vm.frameCount; i++)
+    // a frame of the register machine reads its registers above the top
+    // again once it is back on top, so they must not keep objects freed
+    // meanwhile
+    //
+    // only the slots reserved since the last collection can hold any, and
+    // from now on only those of the frames still running
+    if (vm->registerMachine)
     {
-        markObject((Obj *)vm.frames[i].closure);
+        for (Value *slot = vm->stackTop; slot < vm->stack + vm->stackReserved;
+             slot++)
+        {
+            *slot = NIL_VAL;
+        }
     }
 
-    // open upvalues
-    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
-         upvalue = upvalue->next)
+    // call stacks
+    int reserved = (int)(vm->stackTop - vm->stack);
+    for (int i = 0; i < vm->frameCount; i++)
     {
-        markObject((Obj *)upvalue);
+        CallFrame *frame = &vm->frames[i];
+        markObject((Obj *)frame->closure);
+        int end = (int)(frame->slots - vm->stack) +
+                  frame->closure->function->maxStackSize + STACK_SLACK;
+        if (end > reserved)
+            reserved = end;
     }
+    vm->stackReserved = reserved;
 
     // the globals
-    markTable(&vm.globals);
+    markTable(&vm->globals);
 
     markCompilerRoots();
+    markImageRoots();
 
     // mark the 'init' function string
-    markObject((Obj *)vm.initString);
-}
+    markObject((Obj *)vm->initString);
 
-static void markArray(ValueArray *array)
-{
-    for (int i = 0; i < array->count; i++)
+    // method names keep their slot forever
+    markArray(&vm->methodNames);
+
+    // values the host holds on to
+    for (Handle *handle = vm->handles; handle != NULL; handle = handle->next)
     {
-        markValue(array->values[i]);
+        markValue(handle->value);
+    }
+
+    // immortal objects are never freed or traced, except the ones changed
+    // since the heap was frozen, which may point to mortal objects
+    for (int i = 0; i < vm->rememberedCount; i++)
+    {
+        blackenObject(vm->remembered[i]);
     }
 }
 
@@ -194,6 +322,8 @@ static void blackenObject(Obj *object)
     switch (object->type)
     {
     case OBJ_NATIVE:
+        markObject((Obj *)((ObjNative *)object)->name);
+        break;
     case OBJ_STRING:
         break;
     case OBJ_UPVALUE:
@@ -204,6 +334,7 @@ static void blackenObject(Obj *object)
 
         ObjFunction *function = (ObjFunction *)object;
         markObject((Obj *)function->name);
+        markObject((Obj *)functionState(function)->closure);
         markArray(&function->chunk.constants);
         break;
     }
@@ -221,7 +352,7 @@ static void blackenObject(Obj *object)
     {
         ObjClass *klass = (ObjClass *)object;
         markObject((Obj *)klass->name);
-        markTable(&klass->methods);
+        markArray(&klass->methods);
         break;
     }
     case OBJ_INSTANCE:
@@ -238,6 +369,12 @@ static void blackenObject(Obj *object)
         markObject((Obj *)bound->method);
         break;
     }
+    case OBJ_LIST:
+        markArray(&((ObjList *)object)->elements);
+        break;
+    case OBJ_MAP:
+        markValueTable(&((ObjMap *)object)->entries);
+        break;
     }
 }
 
@@ -246,9 +383,9 @@ static void blackenObject(Obj *object)
 // back objects: Visited by GC and their connections have been made gray
 static void traceReferences()
 {
-    while (vm.grayCount > 0)
+    while (vm->grayCount > 0)
     {
-        Obj *object = vm.grayStack[--vm.grayCount];
+        Obj *object = vm->grayStack[--vm->grayCount];
         blackenObject(object);
     }
 }
@@ -257,12 +394,13 @@ static void traceReferences()
 static void sweep()
 {
     Obj *previous = NULL;
-    Obj *object = vm.objects;
+    Obj *object = vm->objects;
     while (object != NULL)
     {
-        if (object->isMarked)
+        if (vm->marks[object->id] & MARKED)
         {
-            object->isMarked = false;
+            // ready for the next collection
+            vm->marks[object->id] &= ~MARKED;
             previous = object;
             object = object->next;
         } else
@@ -274,8 +412,9 @@ static void sweep()
                 previous->next = object;
             } else
             {
-                vm.objects = object;
+                vm->objects = object;
             }
+            freeId(unreached->id);
             freeObject(unreached);
         }
     }
@@ -291,34 +430,69 @@ void collectGarbage()
 {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
+    size_t before = vm->bytesAllocated;
 #endif
 
     markRoots();
     traceReferences();
     // special treatment to strings due to interning
-    tableRemoveWhite(&vm.strings);
+    tableRemoveWhite(&vm->strings);
     sweep();
 
     // schedule next iteration of GC
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
     printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+           before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
 #endif
 }
 
-void freeObjects()
+void freezeHeap()
+{
+    collectGarbage();
+    if (vm->objects == NULL)
+        return;
+
+    Obj *last = vm->objects;
+    for (;;)
+    {
+        vm->marks[last->id] |= IMMORTAL;
+        if (last->next == NULL)
+            break;
+        last = last->next;
+    }
+    last->next = vm->immortalObjects;
+    vm->immortalObjects = vm->objects;
+    vm->objects = NULL;
+
+    // nothing mortal is left to point at
+    for (int i = 0; i < vm->rememberedCount; i++)
+    {
+        vm->marks[vm->remembered[i]->id] &= ~REMEMBERED;
+    }
+    vm->rememberedCount = 0;
+}
+
+static void freeList(Obj *object)
 {
-    Obj *object = vm.objects;
     while (object != NULL)
     {
         Obj *next = object->next;
         freeObject(object);
         object = next;
     }
+}
 
-    free(vm.grayStack);
+void freeObjects()
+{
+    freeList(vm->objects);
+    freeList(vm->immortalObjects);
+
+    free(vm->grayStack);
+    free(vm->remembered);
+    free(vm->marks);
+    free(vm->freeIds);
+    free(vm->functionStates);
 }
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count)                                                  \
     (type *)reallocate(NULL, 0, sizeof(type) * (count))
@@ -21,13 +22,46 @@
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 
+// the bits of vm->marks
+#define MARKED 0x1
+#define IMMORTAL 0x2
+// an immortal object which is traced by every collection
+#define REMEMBERED 0x4
+
+// the id of a new object
+uint32_t allocateId();
+// give a new function an empty entry in vm->functionStates
+void initFunctionState(ObjFunction *function);
+
 void markObject(Obj *object);
+// whether the current collection reached the object, immortal objects always
+// count as reached
+bool isMarked(Obj *object);
 // mark values which are being used - for GC
 void markValue(Value value);
 
 // the main function for garbage collection
 void collectGarbage();
 
+// collect garbage and make every object left immortal: it is never freed and
+// collections never write to it
+//
+// meant for a heap which is set up once and then shared by fork()ed processes,
+// collections in them keep sharing its pages
+void freezeHeap();
+
+void rememberObject(Obj *object);
+
+// called before a reference is stored into object
+//
+// collections do not trace immortal objects, so one which may now point at a
+// mortal object is remembered and traced from then on
+static inline void writeBarrier(Obj *object)
+{
+    if ((vm->marks[object->id] & (IMMORTAL | REMEMBERED)) == IMMORTAL)
+        rememberObject(object);
+}
+
 void freeObjects();
 
 #endif
\ No newline at end of file
@@ -14,10 +14,10 @@ static Obj *allocateObject(size_t size, ObjType type)
 {
     Obj *object = (Obj *)reallocate(NULL, 0, size);
     object->type = type;
-    object->isMarked = false;
+    object->id = allocateId();
     // update linked list for GC
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
 
 #ifdef DEBUG_LOG_GC
     printf(" %p allocate %zu for %d\n", (void *)object, size, type);
@@ -31,15 +31,21 @@ ObjFunction *newFunction()
     ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxStackSize = 0;
     function->name = NULL;
+    function->loopCount = 0;
     initChunk(&function->chunk);
+    initFunctionState(function);
     return function;
 }
 
-ObjNative *newNative(NativeFn function)
+ObjNative *newNative(ObjString *name, NativeFn function)
 {
     ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->name = name;
+    native->host = NULL;
+    native->data = NULL;
     return native;
 }
 
@@ -67,7 +73,6 @@ ObjUpvalue *newUpvalue(Value *slot)
 {
     ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->location = slot;
-    upvalue->next = NULL;
     upvalue->closed = NIL_VAL;
     return upvalue;
 }
@@ -76,7 +81,7 @@ ObjClass *newClass(ObjString *name)
 {
     ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
-    initTable(&klass->methods);
+    initValueArray(&klass->methods);
     return klass;
 }
 
@@ -96,29 +101,44 @@ ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method)
     return bound;
 }
 
+ObjList *newList()
+{
+    ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    initValueArray(&list->elements);
+    return list;
+}
+
+ObjMap *newMap()
+{
+    ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    initValueTable(&map->entries);
+    return map;
+}
+
 static ObjString *allocateString(char *chars, int length, uint32_t hash)
 {
     ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
+    string->methodSlot = -1;
     // push and pop for GC
     push(OBJ_VAL(string));
     // we are reusing table for string interning as a `HashSet` rather than
     // `HashTable`
-    tableSet(&vm.strings, string, NIL_VAL);
+    tableSet(&vm->strings, string, NIL_VAL);
     pop();
     return string;
 }
 
 // FNV-1a
-static uint32_t hashString(const char *key, int length)
+uint32_t hashString(const char *key, int length)
 {
     uint32_t hash = 2166136261u;
     for (int i = 00; i < length; i++)
     {
         hash ^= (uint8_t)key[i];
-        hash ^= 16777619;
+        hash *= 16777619;
     }
     return hash;
 }
@@ -127,7 +147,7 @@ ObjString *copyString(const char *chars, int length)
 {
     uint32_t hash = hashString(chars, length);
 
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
     // if already present, don't copy and return the same reference
     if (interned != NULL)
         return interned;
@@ -138,6 +158,35 @@ ObjString *copyString(const char *chars, int length)
     return allocateString(heapChars, length, hash);
 }
 
+static void printList(ObjList *list)
+{
+    printf("[");
+    for (int i = 0; i < list->elements.count; i++)
+    {
+        if (i > 0)
+            printf(", ");
+        printValue(list->elements.values[i]);
+    }
+    printf("]");
+}
+
+static void printMap(ObjMap *map)
+{
+    printf("{");
+    bool first = true;
+    ValueEntry *entry;
+    for (int i = 0; (entry = valueTableNext(&map->entries, &i)) != NULL; i++)
+    {
+        if (!first)
+            printf(", ");
+        first = false;
+        printValue(entry->key);
+        printf(": ");
+        printValue(entry->value);
+    }
+    printf("}");
+}
+
 static void printFunction(ObjFunction *function)
 {
     if (function->name == NULL)
@@ -185,6 +234,12 @@ void printObject(Value value)
     case OBJ_BOUND_METHOD:
         printFunction(AS_BOUND_METHOD(value)->method->function);
         break;
+    case OBJ_LIST:
+        printList(AS_LIST(value));
+        break;
+    case OBJ_MAP:
+        printMap(AS_MAP(value));
+        break;
     }
 }
 
@@ -192,7 +247,7 @@ ObjString *takeString(char *chars, int length)
 {
     uint32_t hash = hashString(chars, length);
 
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
     if (interned != NULL)
     {
         FREE_ARRAY(char, chars, length + 1);
@@ -2,6 +2,7 @@
 #define clox_object_h
 
 #include "chunk.h"
+#include "clox.h"
 #include "common.h"
 #include "table.h"
 #include "value.h"
@@ -16,15 +17,19 @@
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
 
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
-#define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
 
 typedef enum
 {
@@ -36,14 +41,17 @@ typedef enum
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_LIST,
+    OBJ_MAP,
 } ObjType;
 
 // type punning / struct inheritance
 struct Obj
 {
     ObjType type;
-    // marking for GC
-    bool isMarked;
+    // where the GC keeps the state of the object in vm->marks, so collecting
+    // only reads the object
+    uint32_t id;
     // create a linked list for garbage collector
     struct Obj *next;
 };
@@ -54,17 +62,33 @@ typedef struct
     Obj obj;
     int arity;
     int upvalueCount;
+    // the most slots the function uses above its frame, computed by the
+    // compiler so that a call reserves stack space once
+    int maxStackSize;
     Chunk chunk;
     ObjString *name;
+    // everything the VM learns while running the function is in its
+    // FunctionState, so the function is never written after it is made
+    int loopCount;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+// returns false for a runtime error, with the message as a string in result
+//
+// a native can call back into lox code with callFromHost, the stack may move
+// then so args must not be used after it
+typedef bool (*NativeFn)(int argCount, Value *args, Value *result);
 
 // native functions like 'time'
 typedef struct
 {
     Obj obj;
     NativeFn function;
+    // the global it is defined as, heap images find natives by it
+    ObjString *name;
+    // natives defined by the host through the embedding API, function is
+    // NULL for them
+    LoxNativeFn host;
+    void *data;
 } ObjNative;
 
 struct ObjString
@@ -79,6 +103,9 @@ struct ObjString
     char *chars;
     // hash for table
     uint32_t hash;
+    // index into the vtable of every class, -1 until some class defines a
+    // method with this name
+    int methodSlot;
 };
 
 // upvalues need to love longer than their function, so they have to be
@@ -89,11 +116,9 @@ typedef struct ObjUpvalue
     Value *location;
     // it stores the value transferred from stack to heap
     Value closed;
-    // linked list which will store the open upvalues slots
-    struct ObjUpvalue *next;
 } ObjUpvalue;
 
-typedef struct
+typedef struct ObjClosure
 {
     Obj obj;
     ObjFunction *function;
@@ -108,7 +133,9 @@ typedef struct
 {
     Obj obj;
     ObjString *name;
-    Table methods;
+    // flattened vtable indexed by the method slot of the name, nil where the
+    // class has no such method
+    ValueArray methods;
 } ObjClass;
 
 typedef struct
@@ -126,14 +153,30 @@ typedef struct
     ObjClosure *method;
 } ObjBoundMethod;
 
+// the elements are stored inline, so indexing is a bounds check and a load
+typedef struct
+{
+    Obj obj;
+    ValueArray elements;
+} ObjList;
+
+typedef struct
+{
+    Obj obj;
+    ValueTable entries;
+} ObjMap;
+
 ObjFunction *newFunction();
 
-ObjNative *newNative(NativeFn function);
+ObjNative *newNative(ObjString *name, NativeFn function);
 
 ObjClosure *newClosure(ObjFunction *function);
 
 ObjUpvalue *newUpvalue(Value *slot);
 
+// FNV-1a hash of the characters
+uint32_t hashString(const char *key, int length);
+
 ObjString *copyString(const char *chars, int length);
 
 ObjString *takeString(char *chars, int length);
@@ -144,6 +187,10 @@ ObjInstance *newInstance(ObjClass *klass);
 
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
 
+ObjList *newList();
+
+ObjMap *newMap();
+
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type)
@@ -1,5 +1,6 @@
 #include "scanner.h"
 #include "common.h"
+#include <assert.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -12,7 +13,7 @@ typedef struct
     int line;
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
 
 void initScanner(const char *source)
 {
@@ -140,73 +141,79 @@ static bool isAlpha(char c)
     return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c == '_');
 }
 
-static TokenType checkKeyword(int start, int length, const char *rest,
-                              TokenType type)
+// every keyword with its first and last character, the hash below only looks
+// at those two and the length, so they are spelled out here to keep the table
+// a compile time constant
+#define KEYWORDS(X)                                                            \
+    X(TOKEN_AND, "and", 'a', 'd')                                              \
+    X(TOKEN_CLASS, "class", 'c', 's')                                          \
+    X(TOKEN_ELSE, "else", 'e', 'e')                                            \
+    X(TOKEN_FALSE, "false", 'f', 'e')                                          \
+    X(TOKEN_FOR, "for", 'f', 'r')                                              \
+    X(TOKEN_FUN, "fun", 'f', 'n')                                              \
+    X(TOKEN_IF, "if", 'i', 'f')                                                \
+    X(TOKEN_NIL, "nil", 'n', 'l')                                              \
+    X(TOKEN_OR, "or", 'o', 'r')                                                \
+    X(TOKEN_PRINT, "print", 'p', 't')                                          \
+    X(TOKEN_RETURN, "return", 'r', 'n')                                        \
+    X(TOKEN_SUPER, "super", 's', 'r')                                          \
+    X(TOKEN_THIS, "this", 't', 's')                                            \
+    X(TOKEN_TRUE, "true", 't', 'e')                                            \
+    X(TOKEN_VAR, "var", 'v', 'r')                                              \
+    X(TOKEN_WHILE, "while", 'w', 'e')
+
+// perfect hash over the keywords above, found by brute force
+//
+// if a new keyword collides, the static assert below fails and the
+// multiplier (or the table size) has to be changed
+#define KEYWORD_SLOTS 32
+#define KEYWORD_HASH(first, last, length)                                      \
+    (((first) + (last)*5 + (length)) & (KEYWORD_SLOTS - 1))
+
+typedef struct
 {
-    // no need to implement trie like structure here
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0)
-    {
-        return type;
-    }
-    return TOKEN_IDENTIFIER;
+    const char *text;
+    int length;
+    TokenType type;
+} Keyword;
+
+#define KEYWORD_ENTRY(type, text, first, last)                                 \
+    [KEYWORD_HASH(first, last, sizeof(text) - 1)] = {text, sizeof(text) - 1,   \
+                                                     type},
+
+// empty slots have length 0, so they never match an identifier
+static const Keyword keywords[KEYWORD_SLOTS] = {KEYWORDS(KEYWORD_ENTRY)};
+
+// with no collisions every keyword owns a distinct bit, so adding the bits is
+// the same as or-ing them
+#define KEYWORD_BIT_OR(type, text, first, last)                                \
+    | (1u << KEYWORD_HASH(first, last, sizeof(text) - 1))
+#define KEYWORD_BIT_ADD(type, text, first, last)                               \
+    +(1u << KEYWORD_HASH(first, last, sizeof(text) - 1))
+_Static_assert((0u KEYWORDS(KEYWORD_BIT_OR)) == (0u KEYWORDS(KEYWORD_BIT_ADD)),
+               "KEYWORD_HASH is not perfect for the keyword set");
+
+// the characters spelled out in KEYWORDS cannot be checked against the text
+// at compile time, and a wrong one would make the keyword an identifier
+void checkKeywords()
+{
+#define KEYWORD_CHECK(type, text, first, last)                                 \
+    assert((first) == (text)[0] && (last) == (text)[sizeof(text) - 2]);
+    KEYWORDS(KEYWORD_CHECK)
+#undef KEYWORD_CHECK
 }
 
-// trie implementation to detect keywords
+// one hash and one compare instead of walking a trie of switches
 static TokenType identifierType()
 {
-    switch (scanner.start[0])
+    int length = (int)(scanner.current - scanner.start);
+    const Keyword *keyword = &keywords[KEYWORD_HASH(
+        scanner.start[0], scanner.start[length - 1], length)];
+    if (keyword->length == length &&
+        memcmp(scanner.start, keyword->text, length) == 0)
     {
-    case 'a':
-        return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'c':
-        return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-    case 'e':
-        return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-    case 'f':
-        if (scanner.current - scanner.start > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'a':
-                return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-            case 'o':
-                return checkKeyword(2, 1, "r", TOKEN_FOR);
-            case 'u':
-                return checkKeyword(2, 1, "n", TOKEN_FUN);
-            }
-        }
-        break;
-    case 'i':
-        return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n':
-        return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o':
-        return checkKeyword(1, 1, "r", TOKEN_OR);
-    case 'p':
-        return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r':
-        return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's':
-        return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-    case 't':
-        if (scanner.current - scanner.start > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'h':
-                return checkKeyword(2, 2, "is", TOKEN_THIS);
-            case 'r':
-                return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-            }
-        }
-        break;
-    case 'v':
-        return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'w':
-        return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+        return keyword->type;
     }
-
     return TOKEN_IDENTIFIER;
 }
 
@@ -240,8 +247,14 @@ Token scanToken()
         return makeToken(TOKEN_LEFT_BRACE);
     case '}':
         return makeToken(TOKEN_RIGHT_BRACE);
+    case '[':
+        return makeToken(TOKEN_LEFT_BRACKET);
+    case ']':
+        return makeToken(TOKEN_RIGHT_BRACKET);
     case ';':
         return makeToken(TOKEN_SEMICOLON);
+    case ':':
+        return makeToken(TOKEN_COLON);
     case ',':
         return makeToken(TOKEN_COMMA);
     case '.':
@@ -8,6 +8,9 @@ typedef enum
     TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE,
     TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET,
+    TOKEN_RIGHT_BRACKET,
+    TOKEN_COLON,
     TOKEN_COMMA,
     TOKEN_DOT,
     TOKEN_MINUS,
@@ -59,6 +62,8 @@ typedef struct
 } Token;
 
 void initScanner(const char *source);
+// assert that the keyword table is consistent, once per VM is enough
+void checkKeywords();
 Token scanToken();
 
 #endif
\ No newline at end of file
@@ -1,58 +1,164 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
 // the max load factor allowed which can cause collision
-#define TABLE_MAX_LOAD 0.75
+//
+// probing looks at a whole group at a time so the table can be fuller than
+// with plain linear probing
+#define TABLE_MAX_LOAD 0.875
+// below this load the table is shrunk on the next insert
+#define TABLE_MIN_LOAD 0.125
+
+// slots are probed in aligned groups of this many control bytes
+#define GROUP_WIDTH 16
+// tables smaller than a group are a single partial group, so that an
+// instance with a few fields does not pay for a whole one
+#define MIN_CAPACITY 4
+
+// the groups of a table are picked by the hash masked with this, tables up to
+// one group wide only have group 0
+#define GROUP_MASK(capacity) ((uint32_t)((capacity)-1) / GROUP_WIDTH)
+
+// control bytes of free slots have the high bit set, full slots store the low
+// 7 bits of the hash of their key
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+#define IS_FULL(control) (((control)&0x80) == 0)
+
+// the low bits go to the control byte, the rest pick the first group
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_CONTROL(hash) ((uint8_t)((hash)&0x7f))
+
+// bit i is set when slot i of the group matched
+typedef uint32_t GroupMask;
+
+static inline GroupMask matchByte(const uint8_t *group, uint8_t byte)
+{
+#ifdef __SSE2__
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    return (GroupMask)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+    {
+        if (group[i] == byte)
+            mask |= (GroupMask)1 << i;
+    }
+    return mask;
+#endif
+}
+
+// empty and deleted slots both have the high bit set
+static inline GroupMask matchFree(const uint8_t *group)
+{
+#ifdef __SSE2__
+    return (GroupMask)_mm_movemask_epi8(
+        _mm_loadu_si128((const __m128i *)group));
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+    {
+        if (!IS_FULL(group[i]))
+            mask |= (GroupMask)1 << i;
+    }
+    return mask;
+#endif
+}
+
+// a group is always loaded whole, so the control bytes of a partial group
+// are padded up to the group width with empty ones, which no key is ever put
+// into
+//
+// being empty, the padding also ends every probe of a small table after its
+// only group
+static int controlSize(int capacity)
+{
+    return capacity > 0 && capacity < GROUP_WIDTH ? GROUP_WIDTH : capacity;
+}
+
+static uint8_t *allocateControl(int capacity)
+{
+    uint8_t *control = ALLOCATE(uint8_t, controlSize(capacity));
+    memset(control, CONTROL_EMPTY, controlSize(capacity));
+    return control;
+}
+
+// pop the lowest matched slot from the mask
+static inline int nextMatch(GroupMask *mask)
+{
+    int index = __builtin_ctz(*mask);
+    *mask &= *mask - 1;
+    return index;
+}
 
 void initTable(Table *table)
 {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 void freeTable(Table *table)
 {
+    FREE_ARRAY(uint8_t, table->control, controlSize(table->capacity));
     FREE_ARRAY(Entry, table->entries, table->capacity);
     initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key)
+// the number of groups is a power of two, so stepping by 1, 2, 3... (a
+// triangular sequence) visits every group before coming back
+//
+// note that we are comparing the address for the strings instead of their
+// values, we are using string interning to ensure that all strings are unique
+static Entry *findEntry(Table *table, ObjString *key)
 {
-    // modulo operator is too slow
-    // modulo to power of two is same as ANS of one minus that power of 2
-    uint32_t index = key->hash & (capacity - 1);
-    Entry *tombstone = NULL;
-    for (;;)
+    uint32_t groupMask = GROUP_MASK(table->capacity);
+    uint32_t group = HASH_GROUP(key->hash) & groupMask;
+    uint8_t control = HASH_CONTROL(key->hash);
+    for (uint32_t step = 1;; step++)
     {
-        Entry *entry = &entries[index];
-        if (entry->key == NULL)
+        const uint8_t *groupControl = &table->control[group * GROUP_WIDTH];
+        GroupMask match = matchByte(groupControl, control);
+        while (match != 0)
         {
-            if (IS_NIL(entry->value))
-            {
-                // Empty entry
-                return tombstone != NULL ? tombstone : entry;
-            } else
-            {
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
-            // note that we are comparing the address for the strings instead of
-            // their values
-            // we are using string interning to ensure that all strings are
-            // unique
-        } else if (entry->key == key)
-        {
-            // found the key
-            return entry;
+            Entry *entry = &table->entries[group * GROUP_WIDTH +
+                                           nextMatch(&match)];
+            if (entry->key == key)
+                return entry;
         }
-        // linear probing
-        index = (index + 1) & (capacity - 1);
+        // a group with an empty slot ends every probe sequence through it
+        if (matchByte(groupControl, CONTROL_EMPTY) != 0)
+            return NULL;
+        group = (group + step) & groupMask;
+    }
+}
+
+// the first empty or deleted slot in the probe sequence of the hash
+static int findFreeSlot(uint8_t *control, int capacity, uint32_t hash)
+{
+    uint32_t groupMask = GROUP_MASK(capacity);
+    uint32_t group = HASH_GROUP(hash) & groupMask;
+    // the padding of a partial group is free but is not part of the table
+    GroupMask slots = capacity < GROUP_WIDTH ? ((GroupMask)1 << capacity) - 1
+                                             : ~(GroupMask)0;
+    for (uint32_t step = 1;; step++)
+    {
+        GroupMask free = matchFree(&control[group * GROUP_WIDTH]) & slots;
+        if (free != 0)
+            return group * GROUP_WIDTH + nextMatch(&free);
+        group = (group + step) & groupMask;
     }
 }
 
@@ -60,8 +166,8 @@ bool tableGet(Table *table, ObjString *key, Value *value)
 {
     if (table->count == 0)
         return false;
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    Entry *entry = findEntry(table, key);
+    if (entry == NULL)
         return false;
     *value = entry->value;
     return true;
@@ -69,71 +175,138 @@ bool tableGet(Table *table, ObjString *key, Value *value)
 
 static void adjustCapacity(Table *table, int capacity)
 {
+    uint8_t *control = allocateControl(capacity);
     Entry *entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++)
-    {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
 
-    // readjust all the values according to the new sizeL-
+    // readjust all the values according to the new size
 
-    // reset count so that we are no longer considering
-    // tombstones from old hash table
+    // reset counts, the tombstones of the old hash table are not copied
     table->count = 0;
+    table->tombstones = 0;
     for (int i = 0; i < table->capacity; i++)
     {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL)
+        if (!IS_FULL(table->control[i]))
             continue;
-        Entry *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        Entry *entry = &table->entries[i];
+        int slot = findFreeSlot(control, capacity, entry->hash);
+        control[slot] = table->control[i];
+        entries[slot] = *entry;
         table->count++;
     }
+    FREE_ARRAY(uint8_t, table->control, controlSize(table->capacity));
     FREE_ARRAY(Entry, table->entries, table->capacity);
+    table->control = control;
     table->entries = entries;
     table->capacity = capacity;
 }
 
-bool tableSet(Table *table, ObjString *key, Value value)
+// the smallest capacity which holds count entries at half the max load, so a
+// freshly resized table has room to grow before it has to resize again
+static int capacityFor(int count)
+{
+    int capacity = MIN_CAPACITY;
+    while (count > capacity * TABLE_MAX_LOAD / 2)
+        capacity *= 2;
+    return capacity;
+}
+
+// the capacity to rebuild a table at before inserting into it, 0 when it
+// does not need to be
+static int insertCapacity(int count, int tombstones, int capacity)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+    if (count + tombstones + 1 > capacity * TABLE_MAX_LOAD)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        // the load factor considers tombstones as occupied, so that there is
+        // always an empty slot to end a probe
+        //
+        // when most of that load is tombstones the table is rebuilt at the
+        // same size, which drops them, instead of being grown
+        if (count + 1 > capacity * TABLE_MAX_LOAD / 2)
+            return capacity == 0 ? MIN_CAPACITY : capacity * 2;
+        return capacity;
     }
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    // we increment count even for tombstones
-    // because we want to ensure that there
-    // is not infinite loop. So the load factor
-    // is now also considering tombstones as occupied
-    if (isNewKey && IS_NIL(entry->value))
-        table->count++;
+    if (capacity > MIN_CAPACITY && count < capacity * TABLE_MIN_LOAD)
+    {
+        // most entries are gone (e.g. after GC swept the interned strings)
+        return capacityFor(count + 1);
+    }
+    return 0;
+}
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+// tables are only resized here and never while deleting, so tableRemoveWhite
+// does not allocate in the middle of a collection
+static void resizeForInsert(Table *table)
+{
+    int capacity =
+        insertCapacity(table->count, table->tombstones, table->capacity);
+    if (capacity != 0)
+        adjustCapacity(table, capacity);
 }
 
-// we need to be careful not to break the sequence formed for linear probing by
-// deleting
+// insert a key which is known to be missing from the table
+static void insertEntry(Table *table, ObjString *key, uint32_t hash,
+                        Value value)
+{
+    resizeForInsert(table);
+
+    int slot = findFreeSlot(table->control, table->capacity, hash);
+    if (table->control[slot] == CONTROL_DELETED)
+        table->tombstones--;
+    table->count++;
+
+    table->control[slot] = HASH_CONTROL(hash);
+    table->entries[slot].key = key;
+    table->entries[slot].hash = hash;
+    table->entries[slot].value = value;
+}
+
+bool tableSet(Table *table, ObjString *key, Value value)
+{
+    Entry *entry = table->count == 0 ? NULL : findEntry(table, key);
+    if (entry != NULL)
+    {
+        entry->value = value;
+        return false;
+    }
+    insertEntry(table, key, key->hash, value);
+    return true;
+}
+
+// we need to be careful not to break the probe sequences which went past this
+// slot
 //
 // therefore, the deleted value leaves a `tombstone` which will still be
-// considered while probing
+// considered while probing, unless its group still has an empty slot, in which
+// case no probe has ever continued past the group
+//
+// true when the slot became a tombstone
+static bool releaseSlot(uint8_t *control, int slot)
+{
+    if (matchByte(&control[slot - slot % GROUP_WIDTH], CONTROL_EMPTY) != 0)
+    {
+        control[slot] = CONTROL_EMPTY;
+        return false;
+    }
+    // place tombstone
+    control[slot] = CONTROL_DELETED;
+    return true;
+}
+
 bool tableDelete(Table *table, ObjString *key)
 {
     if (table->count == 0)
         return false;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    Entry *entry = findEntry(table, key);
+    if (entry == NULL)
         return false;
 
-    // place tombstone
+    if (releaseSlot(table->control, (int)(entry - table->entries)))
+        table->tombstones++;
+    table->count--;
     entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    entry->hash = 0;
+    entry->value = NIL_VAL;
     return true;
 }
 
@@ -141,36 +314,60 @@ void tableAddAll(Table *from, Table *to)
 {
     for (int i = 0; i < from->capacity; i++)
     {
-        Entry *entry = &from->entries[i];
-        if (entry->key != NULL)
+        if (IS_FULL(from->control[i]))
         {
-            tableSet(to, entry->key, entry->value);
+            Entry *entry = &from->entries[i];
+            Entry *existing = to->count == 0 ? NULL : findEntry(to, entry->key);
+            if (existing != NULL)
+            {
+                existing->value = entry->value;
+            } else
+            {
+                insertEntry(to, entry->key, entry->hash, entry->value);
+            }
         }
     }
 }
 
+Entry *tableNext(Table *table, int *index)
+{
+    for (; *index < table->capacity; (*index)++)
+    {
+        if (IS_FULL(table->control[*index]))
+            return &table->entries[*index];
+    }
+    return NULL;
+}
+
 ObjString *tableFindString(Table *table, const char *chars, int length,
                            uint32_t hash)
 {
     if (table->count == 0)
         return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;)
+    uint32_t groupMask = GROUP_MASK(table->capacity);
+    uint32_t group = HASH_GROUP(hash) & groupMask;
+    uint8_t control = HASH_CONTROL(hash);
+    for (uint32_t step = 1;; step++)
     {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL)
-        {
-            // Stop on finding empty non-tombstone entry
-            if (IS_NIL(entry->value))
-                return NULL;
-        } else if (entry->key->length == length && entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0)
+        const uint8_t *groupControl = &table->control[group * GROUP_WIDTH];
+        GroupMask match = matchByte(groupControl, control);
+        while (match != 0)
         {
-            // found
-            return entry->key;
+            Entry *entry =
+                &table->entries[group * GROUP_WIDTH + nextMatch(&match)];
+            // the full hash is checked before following the key pointer
+            if (entry->hash == hash && entry->key->length == length &&
+                memcmp(entry->key->chars, chars, length) == 0)
+            {
+                // found
+                return entry->key;
+            }
         }
-        index = (index + 1) & (table->capacity - 1);
+        // Stop on finding a group with an empty slot
+        if (matchByte(groupControl, CONTROL_EMPTY) != 0)
+            return NULL;
+        group = (group + step) & groupMask;
     }
 }
 
@@ -178,6 +375,8 @@ void markTable(Table *table)
 {
     for (int i = 0; i < table->capacity; i++)
     {
+        if (!IS_FULL(table->control[i]))
+            continue;
         Entry *entry = &table->entries[i];
         markObject((Obj *)entry->key);
         markValue(entry->value);
@@ -189,9 +388,183 @@ void tableRemoveWhite(Table *table)
     for (int i = 0; i < table->capacity; i++)
     {
         Entry *entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked)
+        if (IS_FULL(table->control[i]) && !isMarked((Obj *)entry->key))
         {
             tableDelete(table, entry->key);
         }
     }
-}
\ No newline at end of file
+}
+
+// tables keyed by any value, they probe the same way as the ones above
+
+// numbers are hashed by their bits and objects by their address, except for
+// strings which are interned, so equal keys always have equal hashes
+static uint32_t hashValue(Value key)
+{
+    uint64_t bits;
+    if (IS_NUMBER(key))
+    {
+        // -0 equals 0, so both must hash alike
+        double number = AS_NUMBER(key) == 0 ? 0 : AS_NUMBER(key);
+        memcpy(&bits, &number, sizeof(bits));
+    } else if (IS_STRING(key))
+    {
+        return AS_STRING(key)->hash;
+    } else if (IS_OBJ(key))
+    {
+        bits = (uint64_t)(uintptr_t)AS_OBJ(key);
+    } else
+    {
+        bits = IS_NIL(key) ? 1 : 2 + AS_BOOL(key);
+    }
+    // the murmur3 finalizer, both the control byte and the group come from
+    // the hash so every bit of the key has to reach all of it
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+void initValueTable(ValueTable *table)
+{
+    table->count = 0;
+    table->tombstones = 0;
+    table->capacity = 0;
+    table->control = NULL;
+    table->entries = NULL;
+}
+
+void freeValueTable(ValueTable *table)
+{
+    FREE_ARRAY(uint8_t, table->control, controlSize(table->capacity));
+    FREE_ARRAY(ValueEntry, table->entries, table->capacity);
+    initValueTable(table);
+}
+
+// the full hash is compared before the keys, which only costs a load for
+// strings and objects
+static ValueEntry *findValueEntry(ValueTable *table, Value key, uint32_t hash)
+{
+    uint32_t groupMask = GROUP_MASK(table->capacity);
+    uint32_t group = HASH_GROUP(hash) & groupMask;
+    uint8_t control = HASH_CONTROL(hash);
+    for (uint32_t step = 1;; step++)
+    {
+        const uint8_t *groupControl = &table->control[group * GROUP_WIDTH];
+        GroupMask match = matchByte(groupControl, control);
+        while (match != 0)
+        {
+            ValueEntry *entry =
+                &table->entries[group * GROUP_WIDTH + nextMatch(&match)];
+            if (entry->hash == hash && valuesEqual(entry->key, key))
+                return entry;
+        }
+        if (matchByte(groupControl, CONTROL_EMPTY) != 0)
+            return NULL;
+        group = (group + step) & groupMask;
+    }
+}
+
+bool valueTableGet(ValueTable *table, Value key, Value *value)
+{
+    if (table->count == 0)
+        return false;
+    ValueEntry *entry = findValueEntry(table, key, hashValue(key));
+    if (entry == NULL)
+        return false;
+    *value = entry->value;
+    return true;
+}
+
+static void adjustValueCapacity(ValueTable *table, int capacity)
+{
+    uint8_t *control = allocateControl(capacity);
+    ValueEntry *entries = ALLOCATE(ValueEntry, capacity);
+
+    table->count = 0;
+    table->tombstones = 0;
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (!IS_FULL(table->control[i]))
+            continue;
+        ValueEntry *entry = &table->entries[i];
+        int slot = findFreeSlot(control, capacity, entry->hash);
+        control[slot] = table->control[i];
+        entries[slot] = *entry;
+        table->count++;
+    }
+    FREE_ARRAY(uint8_t, table->control, controlSize(table->capacity));
+    FREE_ARRAY(ValueEntry, table->entries, table->capacity);
+    table->control = control;
+    table->entries = entries;
+    table->capacity = capacity;
+}
+
+bool valueTableSet(ValueTable *table, Value key, Value value)
+{
+    uint32_t hash = hashValue(key);
+    ValueEntry *entry =
+        table->count == 0 ? NULL : findValueEntry(table, key, hash);
+    if (entry != NULL)
+    {
+        entry->value = value;
+        return false;
+    }
+
+    int capacity =
+        insertCapacity(table->count, table->tombstones, table->capacity);
+    if (capacity != 0)
+        adjustValueCapacity(table, capacity);
+
+    int slot = findFreeSlot(table->control, table->capacity, hash);
+    if (table->control[slot] == CONTROL_DELETED)
+        table->tombstones--;
+    table->count++;
+
+    table->control[slot] = HASH_CONTROL(hash);
+    table->entries[slot].key = key;
+    table->entries[slot].hash = hash;
+    table->entries[slot].value = value;
+    return true;
+}
+
+bool valueTableDelete(ValueTable *table, Value key)
+{
+    if (table->count == 0)
+        return false;
+
+    ValueEntry *entry = findValueEntry(table, key, hashValue(key));
+    if (entry == NULL)
+        return false;
+
+    if (releaseSlot(table->control, (int)(entry - table->entries)))
+        table->tombstones++;
+    table->count--;
+    entry->key = NIL_VAL;
+    entry->hash = 0;
+    entry->value = NIL_VAL;
+    return true;
+}
+
+ValueEntry *valueTableNext(ValueTable *table, int *index)
+{
+    for (; *index < table->capacity; (*index)++)
+    {
+        if (IS_FULL(table->control[*index]))
+            return &table->entries[*index];
+    }
+    return NULL;
+}
+
+void markValueTable(ValueTable *table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (!IS_FULL(table->control[i]))
+            continue;
+        markValue(table->entries[i].key);
+        markValue(table->entries[i].value);
+    }
+}
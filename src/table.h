@@ -1,6 +1,10 @@
 // the hash table which will map identifiers to values
 //
-// linear probing + FNV-1a hash
+// swiss table style open addressing + FNV-1a hash
+//
+// every slot has a one byte control word next to the entries array which keeps
+// 7 bits of the key's hash, so a probe compares a whole group of slots at once
+// and only touches the entries whose control byte matches
 
 #ifndef clox_table_h
 #define clox_table_h
@@ -11,13 +15,21 @@
 typedef struct
 {
     ObjString *key;
+    // copy of key->hash, so probing and resizing never have to follow the key
+    // pointer
+    uint32_t hash;
     Value value;
 } Entry;
 
 typedef struct
 {
+    // number of live entries
     int count;
+    // deleted slots which still have to be walked over by probes
+    int tombstones;
     int capacity;
+    // one control byte per slot: empty, deleted or low 7 bits of the hash
+    uint8_t *control;
     // the array of entries
     Entry *entries;
 } Table;
@@ -29,6 +41,9 @@ bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
 // copy all entries of one hash table to other -> when we need inheritance
 void tableAddAll(Table *from, Table *to);
+// the first live entry at or after *index, which is moved to it, NULL when
+// there is none
+Entry *tableNext(Table *table, int *index);
 ObjString *tableFindString(Table *table, const char *chars, int length,
                            uint32_t hash);
 
@@ -37,4 +52,30 @@ void markTable(Table *table);
 // remove unreachable from table for GC
 void tableRemoveWhite(Table *table);
 
-#endif
\ No newline at end of file
+// the same table keyed by any value instead of a string, keys are equal when
+// valuesEqual says so
+typedef struct
+{
+    Value key;
+    uint32_t hash;
+    Value value;
+} ValueEntry;
+
+typedef struct
+{
+    int count;
+    int tombstones;
+    int capacity;
+    uint8_t *control;
+    ValueEntry *entries;
+} ValueTable;
+
+void initValueTable(ValueTable *table);
+void freeValueTable(ValueTable *table);
+bool valueTableGet(ValueTable *table, Value key, Value *value);
+bool valueTableSet(ValueTable *table, Value key, Value value);
+bool valueTableDelete(ValueTable *table, Value key);
+ValueEntry *valueTableNext(ValueTable *table, int *index);
+void markValueTable(ValueTable *table);
+
+#endif
@@ -3,33 +3,143 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "scanner.h"
 #include "table.h"
 #include "value.h"
 
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <time.h>
 
-VM vm;
+_Thread_local VM *vm = NULL;
 
-static Value clockNative(int argCount, Value *args)
+// frames shown at each end of the trace of a runtime error
+#define TRACE_FRAMES 10
+
+static bool clockNative(int argCount, Value *args, Value *result)
+{
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+// the number of elements of a list, entries of a map or characters of a
+// string
+static bool lenNative(int argCount, Value *args, Value *result)
+{
+    if (argCount == 1 && IS_LIST(args[0]))
+    {
+        *result = NUMBER_VAL(AS_LIST(args[0])->elements.count);
+        return true;
+    }
+    if (argCount == 1 && IS_MAP(args[0]))
+    {
+        *result = NUMBER_VAL(AS_MAP(args[0])->entries.count);
+        return true;
+    }
+    if (argCount == 1 && IS_STRING(args[0]))
+    {
+        *result = NUMBER_VAL(AS_STRING(args[0])->length);
+        return true;
+    }
+    *result = OBJ_VAL(copyString("Expected a list, a map or a string", 34));
+    return false;
+}
+
+// the arguments stay on the stack while the list grows, so they are safe
+// from GC
+static bool appendNative(int argCount, Value *args, Value *result)
+{
+    if (argCount != 2 || !IS_LIST(args[0]))
+    {
+        *result = OBJ_VAL(copyString("Expected a list and a value", 27));
+        return false;
+    }
+    writeBarrier(AS_OBJ(args[0]));
+    writeValueArray(&AS_LIST(args[0])->elements, args[1]);
+    *result = NIL_VAL;
+    return true;
+}
+
+static bool mapArguments(int argCount, int expected, Value *args,
+                         Value *result)
+{
+    if (argCount == expected && IS_MAP(args[0]))
+        return true;
+    *result = OBJ_VAL(copyString("Expected a map", 14));
+    return false;
+}
+
+// a list of the keys of a map, which is how scripts iterate over it
+//
+// the elements are allocated before the list, so nothing unreachable is
+// alive when the list allocation collects
+static bool keysNative(int argCount, Value *args, Value *result)
+{
+    if (!mapArguments(argCount, 1, args, result))
+        return false;
+    ValueTable *entries = &AS_MAP(args[0])->entries;
+    Value *keys = ALLOCATE(Value, entries->count);
+    int count = 0;
+    ValueEntry *entry;
+    for (int i = 0; (entry = valueTableNext(entries, &i)) != NULL; i++)
+    {
+        keys[count++] = entry->key;
+    }
+    ObjList *list = newList();
+    list->elements.values = keys;
+    list->elements.capacity = count;
+    list->elements.count = count;
+    *result = OBJ_VAL(list);
+    return true;
+}
+
+static bool hasNative(int argCount, Value *args, Value *result)
+{
+    if (!mapArguments(argCount, 2, args, result))
+        return false;
+    Value value;
+    *result =
+        BOOL_VAL(valueTableGet(&AS_MAP(args[0])->entries, args[1], &value));
+    return true;
+}
+
+// true when the key was in the map
+static bool removeNative(int argCount, Value *args, Value *result)
 {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    if (!mapArguments(argCount, 2, args, result))
+        return false;
+    *result = BOOL_VAL(valueTableDelete(&AS_MAP(args[0])->entries, args[1]));
+    return true;
 }
 
 static void resetStack()
 {
-    // the stack is not allocated and need not be freed
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    // the stack keeps its capacity
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    // upvalues left open by an error are dropped
+    memset(vm->openUpvalues, 0, sizeof(ObjUpvalue *) * vm->stackCapacity);
+}
+
+// the code the frame runs, which for the register machine is the stack code
+// of a function it could not translate and of everything that one calls
+static Chunk *frameChunk(CallFrame *frame)
+{
+    Chunk *registers = &functionState(frame->closure->function)->registers;
+    if (registers->code != NULL && frame->ip >= registers->code &&
+        frame->ip < registers->code + registers->count)
+        return registers;
+    return &frame->closure->function->chunk;
 }
 
-static void runtimeError(const char *format, ...)
+void runtimeError(const char *format, ...)
 {
     va_list args;
     va_start(args, format);
@@ -37,13 +147,20 @@ static void runtimeError(const char *format, ...)
     va_end(args);
     fputs("\n", stderr);
 
-    // show call stack
-    for (int i = vm.frameCount - 1; i >= 0; i--)
+    // show call stack, a deep one only by its innermost and outermost frames
+    int skipped = vm->frameCount - 2 * TRACE_FRAMES;
+    for (int i = vm->frameCount - 1; i >= 0; i--)
     {
-        CallFrame *frame = &vm.frames[i];
+        if (skipped > 0 && i == TRACE_FRAMES + skipped - 1)
+        {
+            fprintf(stderr, "... %d more frames ...\n", skipped);
+            i = TRACE_FRAMES - 1;
+        }
+        CallFrame *frame = &vm->frames[i];
         ObjFunction *function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        Chunk *chunk = frameChunk(frame);
+        size_t instruction = frame->ip - chunk->code - 1;
+        fprintf(stderr, "[line %d] in ", chunk->lines[instruction]);
         if (function->name == NULL)
         {
             fprintf(stderr, "script\n");
@@ -60,77 +177,355 @@ static void defineNative(const char *name, NativeFn function)
 {
     // push and then pop beacuse of GC
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJ_VAL(newNative(AS_STRING(vm->stack[0]), function)));
+    tableSet(&vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
     pop();
     pop();
 }
 
-void initVM()
+#ifdef DEBUG_LOG_HOT
+static void logHot(ObjFunction *function, int loop)
+{
+    const char *name =
+        function->name != NULL ? function->name->chars : "script";
+    if (loop < 0)
+        printf("-- hot %s\n", name);
+    else
+        printf("-- hot loop %d in %s\n", loop, name);
+}
+#endif
+
+#ifdef BASELINE_JIT
+// the backend for --jit, a function is compiled once, the first time it or
+// one of its loops gets hot, and the register machine keeps its own code
+static void jitTierUp(ObjFunction *function, int loop)
+{
+#ifdef DEBUG_LOG_HOT
+    logHot(function, loop);
+#endif
+    if (functionState(function)->native == NULL && !vm->registerMachine)
+        jitCompile(function);
+}
+
+void enableJit(VM *instance)
+{
+    instance->tierUp = jitTierUp;
+}
+#endif
+
+static void initVM()
 {
+    checkKeywords();
+    // the stacks are allocated manually like the gray stack, GC must not run
+    // while they are being moved
+    vm->frameCapacity = FRAMES_INITIAL;
+    vm->framesMax = FRAMES_MAX;
+    vm->frames = (CallFrame *)malloc(sizeof(CallFrame) * vm->frameCapacity);
+    vm->stackCapacity = STACK_INITIAL;
+    vm->stackMax = STACK_MAX;
+    vm->stackReserved = 0;
+    vm->stack = (Value *)malloc(sizeof(Value) * vm->stackCapacity);
+    vm->openUpvalues =
+        (ObjUpvalue **)malloc(sizeof(ObjUpvalue *) * vm->stackCapacity);
+    if (vm->frames == NULL || vm->stack == NULL || vm->openUpvalues == NULL)
+        exit(1);
+    // the register machine leaves values above the top, see markRoots
+    for (int i = 0; i < vm->stackCapacity; i++)
+    {
+        vm->stack[i] = NIL_VAL;
+    }
+
     resetStack();
-    vm.objects = NULL;
+    vm->registerMachine = false;
+    vm->registerOperands = true;
+    vm->objects = NULL;
+    vm->immortalObjects = NULL;
+    vm->handles = NULL;
+    vm->hostCallDepth = 0;
+
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
 
-    vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
 
-    vm.grayCount = 0;
-    vm.grayCapacity = 0;
-    vm.grayStack = NULL;
+    vm->remembered = NULL;
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
 
-    initTable(&vm.strings);
-    initTable(&vm.globals);
+    vm->marks = NULL;
+    vm->idCount = 0;
+    vm->idCapacity = 0;
+    vm->freeIds = NULL;
+    vm->freeIdCount = 0;
+    vm->freeIdCapacity = 0;
+    vm->functionStates = NULL;
+    vm->functionStateCapacity = 0;
+
+    initTable(&vm->strings);
+    initTable(&vm->globals);
+    initValueArray(&vm->methodNames);
 
     // we cant let GC run at initial string allocation, so first chagge to NULL
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
+    vm->initString = NULL;
+    vm->initString = copyString("init", 4);
 
     defineNative("clock", clockNative);
+    defineNative("len", lenNative);
+    defineNative("append", appendNative);
+    defineNative("keys", keysNative);
+    defineNative("has", hasNative);
+    defineNative("remove", removeNative);
+
+    vm->mappedFiles = NULL;
+
+#ifdef DEBUG_LOG_HOT
+    vm->tierUp = logHot;
+#else
+    vm->tierUp = NULL;
+#endif
+}
+
+VM *newVM()
+{
+    VM *instance = (VM *)malloc(sizeof(VM));
+    if (instance == NULL)
+        exit(1);
+    vm = instance;
+    initVM();
+    return instance;
 }
 
-void freeVM()
+void freeVM(VM *instance)
 {
-    freeTable(&vm.strings);
-    freeTable(&vm.globals);
-    vm.initString = NULL;
+    VM *previous = vm;
+    vm = instance;
+    freeTable(&vm->strings);
+    freeTable(&vm->globals);
+    freeValueArray(&vm->methodNames);
+    vm->initString = NULL;
     freeObjects();
+    while (vm->mappedFiles != NULL)
+    {
+        MappedFile *next = vm->mappedFiles->next;
+        munmap(vm->mappedFiles->start, vm->mappedFiles->size);
+        free(vm->mappedFiles);
+        vm->mappedFiles = next;
+    }
+    while (vm->handles != NULL)
+    {
+        Handle *next = vm->handles->next;
+        free(vm->handles);
+        vm->handles = next;
+    }
+    free(vm->frames);
+    free(vm->stack);
+    free(vm->openUpvalues);
+    free(instance);
+    vm = previous != instance ? previous : NULL;
+}
+
+void setVM(VM *instance)
+{
+    vm = instance;
 }
 
 void push(Value value)
 {
-    *vm.stackTop = value;
-    vm.stackTop++;
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
 Value pop()
 {
-    vm.stackTop--;
-    return *vm.stackTop;
+    vm->stackTop--;
+    return *vm->stackTop;
+}
+
+static Value peek(int distance) { return vm->stackTop[-1 - distance]; }
+
+// the slot of a whole number index within the list
+static bool listIndex(ObjList *list, Value index, int *slot)
+{
+    if (!IS_NUMBER(index))
+    {
+        runtimeError("List index must be a number");
+        return false;
+    }
+    // written so that NaN is out of bounds too
+    double number = AS_NUMBER(index);
+    if (!(number >= 0 && number < list->elements.count))
+    {
+        runtimeError("List index out of bounds");
+        return false;
+    }
+    *slot = (int)number;
+    if (*slot != number)
+    {
+        runtimeError("List index must be a whole number");
+        return false;
+    }
+    return true;
 }
 
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+// NaN is not equal to itself, so it could never be found again
+static bool mapSet(ObjMap *map, Value key, Value value)
+{
+    if (IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key))
+    {
+        runtimeError("Map key cannot be NaN");
+        return false;
+    }
+    writeBarrier((Obj *)map);
+    valueTableSet(&map->entries, key, value);
+    return true;
+}
 
 static bool isFalsey(Value value)
 {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+// both strings must be reachable by the GC while the result is allocated
+static ObjString *concatenateStrings(ObjString *a, ObjString *b)
 {
-    // peek instead of pop to avoid GC freeing it just now
-    ObjString *b = AS_STRING(peek(0));
-    ObjString *a = AS_STRING(peek(1));
     int length = a->length + b->length;
     char *chars = ALLOCATE(char, length + 1);
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
-    ObjString *result = takeString(chars, length);
+    return takeString(chars, length);
+}
+
+static void concatenate()
+{
+    // peek instead of pop to avoid GC freeing it just now
+    ObjString *result =
+        concatenateStrings(AS_STRING(peek(1)), AS_STRING(peek(0)));
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
+static bool growFrames()
+{
+    if (vm->frameCapacity >= vm->framesMax)
+        return false;
+    int capacity = vm->frameCapacity * 2;
+    if (capacity > vm->framesMax)
+        capacity = vm->framesMax;
+    CallFrame *frames =
+        (CallFrame *)realloc(vm->frames, sizeof(CallFrame) * capacity);
+    if (frames == NULL)
+        exit(1);
+    vm->frames = frames;
+    vm->frameCapacity = capacity;
+    return true;
+}
+
+// move the stack to a bigger block which can hold `needed` values and fix up
+// every pointer into the old one
+static bool growStack(int needed)
+{
+    if (needed > vm->stackMax)
+        return false;
+    int capacity = vm->stackCapacity;
+    while (capacity < needed)
+        capacity *= 2;
+    if (capacity > vm->stackMax)
+        capacity = vm->stackMax;
+
+    Value *stack = (Value *)malloc(sizeof(Value) * capacity);
+    if (stack == NULL)
+        exit(1);
+    Value *old = vm->stack;
+    memcpy(stack, old, sizeof(Value) * (vm->stackTop - old));
+    for (Value *slot = stack + (vm->stackTop - old); slot < stack + capacity;
+         slot++)
+    {
+        *slot = NIL_VAL;
+    }
+
+    ObjUpvalue **openUpvalues =
+        (ObjUpvalue **)malloc(sizeof(ObjUpvalue *) * capacity);
+    if (openUpvalues == NULL)
+        exit(1);
+    int count = (int)(vm->stackTop - old);
+    memcpy(openUpvalues, vm->openUpvalues, sizeof(ObjUpvalue *) * count);
+    memset(openUpvalues + count, 0,
+           sizeof(ObjUpvalue *) * (capacity - count));
+
+    vm->stackTop = stack + count;
+    for (int i = 0; i < vm->frameCount; i++)
+    {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - old);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (openUpvalues[i] != NULL)
+            openUpvalues[i]->location = &stack[i];
+    }
+
+    free(old);
+    free(vm->openUpvalues);
+    vm->openUpvalues = openUpvalues;
+    vm->stack = stack;
+    vm->stackCapacity = capacity;
+    return true;
+}
+
+// make room for the function's frame starting at index base of the stack
+static inline bool reserveStack(int base, ObjFunction *function)
+{
+    int needed = base + function->maxStackSize + STACK_SLACK;
+    if (needed > vm->stackCapacity && !growStack(needed))
+    {
+        runtimeError("Stack overflow");
+        return false;
+    }
+    if (needed > vm->stackReserved)
+        vm->stackReserved = needed;
+    return true;
+}
+
+// bump a hotness counter, true when it has just reached the threshold and
+// there is a backend to tell, which then only hears about it once
+static inline bool countHotness(uint32_t *counter, uint32_t threshold)
+{
+#ifdef HOTNESS_COUNTERS
+    if (*counter == UINT32_MAX)
+        return false;
+    return ++*counter == threshold && vm->tierUp != NULL;
+#else
+    return false;
+#endif
+}
+
+// the first instruction of the function for the running machine, the
+// register machine translates a function the first time it is called
+//
+// the caller is the frame on top, and one running stack code keeps everything
+// it calls on stack code as well
+static inline uint8_t *entryPoint(ObjFunction *function)
+{
+    FunctionState *state = functionState(function);
+    if (!vm->registerMachine || state->stackOnly)
+        return function->chunk.code;
+    if (vm->frameCount > 0)
+    {
+        CallFrame *caller = &vm->frames[vm->frameCount - 1];
+        if (frameChunk(caller) == &caller->closure->function->chunk)
+            return function->chunk.code;
+    }
+    if (state->registers.code == NULL && !compileRegisters(function))
+    {
+        state->stackOnly = true;
+        return function->chunk.code;
+    }
+    return state->registers.code;
+}
+
 static bool call(ObjClosure *closure, int argCount)
 {
     if (argCount != closure->function->arity)
@@ -140,17 +535,39 @@ static bool call(ObjClosure *closure, int argCount)
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX)
+    // the only bounds checks, pushes inside the frame never check for room
+    if (vm->frameCount == vm->frameCapacity && !growFrames())
     {
         runtimeError("Stack overflow");
         return false;
     }
+    if (!reserveStack((int)(vm->stackTop - argCount - 1 - vm->stack),
+                      closure->function))
+        return false;
+    uint8_t *ip = entryPoint(closure->function);
 
-    CallFrame *frame = &vm.frames[vm.frameCount++];
+    CallFrame *frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->ip = ip;
     // -1 because slot 0 is for methods
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = vm->stackTop - argCount - 1;
+    frame->openUpvalueCount = 0;
+    if (countHotness(&functionState(closure->function)->callCount,
+                     HOT_CALL_THRESHOLD))
+        vm->tierUp(closure->function, -1);
+    return true;
+}
+
+// method lookup is a single index into the vtable of the class, no hashing
+static inline bool findMethod(ObjClass *klass, ObjString *name, Value *method)
+{
+    int slot = name->methodSlot;
+    if (slot < 0 || slot >= klass->methods.count ||
+        IS_NIL(klass->methods.values[slot]))
+    {
+        return false;
+    }
+    *method = klass->methods.values[slot];
     return true;
 }
 
@@ -167,20 +584,39 @@ static bool callValue(Value callee, int argCount)
         }
         case OBJ_NATIVE:
         {
-            NativeFn native = AS_NATIVE(callee);
-            Value result = native(argCount, vm.stackTop - argCount);
-            vm.stackTop -= argCount + 1;
+            ObjNative *native = AS_NATIVE(callee);
+            // an index, the stack can move if the native calls lox code
+            int calleeSlot = (int)(vm->stackTop - argCount - 1 - vm->stack);
+            Value *args = vm->stackTop - argCount;
+            Value result = NIL_VAL;
+            bool succeeded =
+                native->host == NULL
+                    ? native->function(argCount, args, &result)
+                    : callHostNative(native, argCount, args, &result);
+
+            // an error in lox code called by the native has been reported,
+            // and has reset the stack, already
+            bool reset = vm->stackTop - vm->stack <= calleeSlot;
+            if (!succeeded || reset)
+            {
+                if (!reset)
+                    runtimeError("%s", IS_STRING(result)
+                                           ? AS_CSTRING(result)
+                                           : "Native call failed.");
+                return false;
+            }
+            vm->stackTop = vm->stack + calleeSlot;
             push(result);
             return true;
         }
         case OBJ_CLASS:
         {
             ObjClass *klass = AS_CLASS(callee);
-            vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+            vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
 
             // init() method
             Value initializer;
-            if (tableGet(&klass->methods, vm.initString, &initializer))
+            if (findMethod(klass, vm->initString, &initializer))
             {
                 return call(AS_CLOSURE(initializer), argCount);
             } else if (argCount != 0)
@@ -194,7 +630,7 @@ static bool callValue(Value callee, int argCount)
         {
             ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
             // put the 'this' variable at slot zero
-            vm.stackTop[-argCount - 1] = bound->receiver;
+            vm->stackTop[-argCount - 1] = bound->receiver;
             return call(bound->method, argCount);
         }
         default:
@@ -206,56 +642,117 @@ static bool callValue(Value callee, int argCount)
     return false;
 }
 
+// closures only capture slots of the running frame
 static ObjUpvalue *captureUpvalue(Value *local)
 {
-
     // look for existing upvalue
-    ObjUpvalue *prevUpvalue = NULL;
-    ObjUpvalue *upvalue = vm.openUpvalues;
-
-    while (upvalue != NULL && upvalue->location > local)
+    ObjUpvalue **upvalue = &vm->openUpvalues[local - vm->stack];
+    if (*upvalue != NULL)
     {
-        prevUpvalue = upvalue;
-        upvalue = upvalue->next;
+        return *upvalue;
     }
 
-    if (upvalue != NULL && upvalue->location == local)
+    // create new upvalue
+    *upvalue = newUpvalue(local);
+    vm->frames[vm->frameCount - 1].openUpvalueCount++;
+    return *upvalue;
+}
+
+// at this instruction, free up the stack and put the upvalues on heap
+//
+// only the slots of the running frame can be open above last, and the scan
+// stops as soon as all of them are closed, so frames which never captured
+// anything pay nothing
+static void closeUpvalues(Value *last)
+{
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    for (Value *slot = last; frame->openUpvalueCount > 0 && slot < vm->stackTop;
+         slot++)
     {
-        return upvalue;
+        ObjUpvalue *upvalue = vm->openUpvalues[slot - vm->stack];
+        if (upvalue == NULL)
+            continue;
+        writeBarrier((Obj *)upvalue);
+        upvalue->closed = *slot;
+        upvalue->location = &upvalue->closed;
+        vm->openUpvalues[slot - vm->stack] = NULL;
+        frame->openUpvalueCount--;
     }
+}
 
-    // create new upvalue
-    ObjUpvalue *createdUpvalue = newUpvalue(local);
-    // insert the upvalue in the sorted manner
-    createdUpvalue->next = upvalue;
-    if (prevUpvalue == NULL)
+// every method name gets a global slot number the first time a class defines
+// it, like selector numbering in smalltalk, so all vtables agree on where a
+// method lives
+static int methodSlot(ObjString *name)
+{
+    if (name->methodSlot == -1)
     {
-        vm.openUpvalues = createdUpvalue;
-    } else
+        writeValueArray(&vm->methodNames, OBJ_VAL(name));
+        name->methodSlot = vm->methodNames.count - 1;
+    }
+    return name->methodSlot;
+}
+
+// grow the vtable with empty slots until the slot fits
+static void reserveMethodSlot(ObjClass *klass, int slot)
+{
+    while (klass->methods.count <= slot)
     {
-        prevUpvalue->next = createdUpvalue;
+        writeValueArray(&klass->methods, NIL_VAL);
     }
-    return createdUpvalue;
 }
 
-// at this instruction, free up the stack and put the upvalues on heap
-static void closeUpvalues(Value *last)
+// a call in tail position reuses the frame of the caller, the callee and its
+// arguments are slid down over the caller's slots
+//
+// anything which is not a closure is called normally
+static bool tailCall(Value callee, int argCount)
 {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last)
+    if (IS_BOUND_METHOD(callee))
     {
-        ObjUpvalue *upvalue = vm.openUpvalues;
-        upvalue->closed = *upvalue->location;
-        upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        callee = OBJ_VAL(bound->method);
+    } else if (!IS_CLOSURE(callee))
+    {
+        return callValue(callee, argCount);
+    }
+
+    ObjClosure *closure = AS_CLOSURE(callee);
+    if (argCount != closure->function->arity)
+    {
+        runtimeError("Expected %d arguments but got %d",
+                     closure->function->arity, argCount);
+        return false;
     }
+
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    if (!reserveStack((int)(frame->slots - vm->stack), closure->function))
+        return false;
+    uint8_t *ip = entryPoint(closure->function);
+
+    // the caller's locals are about to be overwritten
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, vm->stackTop - argCount - 1,
+            sizeof(Value) * (argCount + 1));
+    vm->stackTop = frame->slots + argCount + 1;
+    frame->closure = closure;
+    frame->ip = ip;
+    if (countHotness(&functionState(closure->function)->callCount,
+                     HOT_CALL_THRESHOLD))
+        vm->tierUp(closure->function, -1);
+    return true;
 }
 
 static void defineMethod(ObjString *name)
 {
     Value method = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
-    // add the closure to methods table
-    tableSet(&klass->methods, name, method);
+    int slot = methodSlot(name);
+    // add the closure to the vtable
+    reserveMethodSlot(klass, slot);
+    writeBarrier((Obj *)klass);
+    klass->methods.values[slot] = method;
     // remove the closure
     pop();
 }
@@ -263,7 +760,7 @@ static void defineMethod(ObjString *name)
 static bool bindMethod(ObjClass *klass, ObjString *name)
 {
     Value method;
-    if (!tableGet(&klass->methods, name, &method))
+    if (!findMethod(klass, name, &method))
     {
         runtimeError("Undefined property '%s'", name->chars);
         return false;
@@ -274,10 +771,38 @@ static bool bindMethod(ObjClass *klass, ObjString *name)
     return true;
 }
 
+// leave the receiver where it is and push the method without binding it
+//
+// a field is pushed as is, and the receiver is replaced by nil to tell that
+// the value must not be bound to it
+static bool getMethod(ObjClass *klass, ObjString *name)
+{
+    Value method;
+    if (!findMethod(klass, name, &method))
+    {
+        runtimeError("Undefined property '%s'", name->chars);
+        return false;
+    }
+    push(method);
+    return true;
+}
+
+// the slot below a local read by OP_GET_METHOD holds its receiver, turn the
+// pair into a plain value (a real bound method) once it escapes
+static Value bindLocal(Value *slot)
+{
+    if (!IS_NIL(slot[-1]))
+    {
+        slot[0] = OBJ_VAL(newBoundMethod(slot[-1], AS_CLOSURE(slot[0])));
+        slot[-1] = NIL_VAL;
+    }
+    return slot[0];
+}
+
 static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount)
 {
     Value method;
-    if (!tableGet(&klass->methods, name, &method))
+    if (!findMethod(klass, name, &method))
     {
         runtimeError("Undefined property '%s'", name->chars);
         return false;
@@ -299,95 +824,495 @@ static bool invoke(ObjString *name, int argCount)
     Value value;
     if (tableGet(&instance->fields, name, &value))
     {
-        vm.stackTop[-argCount - 1] = value;
+        vm->stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
 
     return invokeFromClass(instance->klass, name, argCount);
 }
 
-static InterpretResult run()
+#ifdef BASELINE_JIT
+bool jitGetGlobal(ObjString *name)
 {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
-    // macros
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT()                                                        \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_SHORT()                                                           \
-    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-// do while loop is to ensure macro is hygenic
-#define BINARY_OP(valueType, op)                                               \
-    do                                                                         \
-    {                                                                          \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)))                        \
-        {                                                                      \
-            runtimeError("Operands must be numbers");                          \
-            return INTERPRET_RUNTIME_ERROR;                                    \
-        }                                                                      \
-        double b = AS_NUMBER(pop());                                           \
-        double a = AS_NUMBER(pop());                                           \
-        push(valueType(a op b));                                               \
-    } while (false)
+    Value value;
+    if (!tableGet(&vm->globals, name, &value))
+    {
+        runtimeError("Undefined variable '%s'", name->chars);
+        return false;
+    }
+    push(value);
+    return true;
+}
 
-    // main loop
-    for (;;)
+bool jitSetGlobal(ObjString *name)
+{
+    if (tableSet(&vm->globals, name, peek(0)))
     {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
-        {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(
-            &frame->closure->function->chunk,
-            (int)(frame->ip - frame->closure->function->chunk.code));
-#endif
-        uint8_t instruction;
-        // dispatchinig the instruction
-        switch (instruction = READ_BYTE())
-        {
-        case OP_CONSTANT:
-        {
-            Value constant = READ_CONSTANT();
-            push(constant);
-            break;
-        }
-        case OP_PRINT:
-        {
-            printValue(pop());
-            // we dont push back value in statement
-            // statement has total stack effect fo zero
-            printf("\n");
-            break;
-        }
-        case OP_JUMP_IF_FALSE:
-        {
-            uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0)))
-                frame->ip += offset;
-            break;
-        }
-        case OP_JUMP:
-        {
+        tableDelete(&vm->globals, name);
+        runtimeError("Undefined Variable '%s'", name->chars);
+        return false;
+    }
+    return true;
+}
+
+void jitDefineGlobal(ObjString *name)
+{
+    tableSet(&vm->globals, name, peek(0));
+    pop();
+}
+
+void jitSetUpvalue(int slot)
+{
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+    writeBarrier((Obj *)upvalue);
+    *upvalue->location = peek(0);
+}
+
+void jitPrint()
+{
+    printValue(pop());
+    printf("\n");
+}
+
+bool jitArithmetic(OpCode op)
+{
+    if (op == OP_NEGATE)
+    {
+        runtimeError("Operand must be a number");
+        return false;
+    }
+    if (op != OP_ADD)
+    {
+        runtimeError("Operands must be numbers");
+        return false;
+    }
+    if (!IS_STRING(peek(0)) || !IS_STRING(peek(1)))
+    {
+        runtimeError("Operands must be two numbers or two string");
+        return false;
+    }
+    concatenate();
+    return true;
+}
+
+JitCall jitCall(int argCount)
+{
+    int frameCount = vm->frameCount;
+    if (!callValue(peek(argCount), argCount))
+        return CALL_FAILED;
+    return vm->frameCount > frameCount ? CALL_PUSHED : CALL_DONE;
+}
+
+JitCall jitInvoke(ObjString *name, int argCount)
+{
+    int frameCount = vm->frameCount;
+    if (!invoke(name, argCount))
+        return CALL_FAILED;
+    return vm->frameCount > frameCount ? CALL_PUSHED : CALL_DONE;
+}
+
+bool jitTailCall(int argCount)
+{
+    return tailCall(peek(argCount), argCount);
+}
+
+void jitReturn()
+{
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    Value result = pop();
+    closeUpvalues(frame->slots);
+    vm->frameCount--;
+    vm->stackTop = frame->slots;
+    push(result);
+}
+
+void jitCloseUpvalue()
+{
+    closeUpvalues(vm->stackTop - 1);
+    pop();
+}
+
+bool jitGetProperty(ObjString *name)
+{
+    if (!IS_INSTANCE(peek(0)))
+    {
+        runtimeError("Only instances have properties");
+        return false;
+    }
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+    Value value;
+    if (tableGet(&instance->fields, name, &value))
+    {
+        vm->stackTop[-1] = value;
+        return true;
+    }
+    return bindMethod(instance->klass, name);
+}
+
+bool jitSetProperty(ObjString *name)
+{
+    if (!IS_INSTANCE(peek(1)))
+    {
+        runtimeError("Only instances have fields");
+        return false;
+    }
+    ObjInstance *instance = AS_INSTANCE(peek(1));
+    writeBarrier((Obj *)instance);
+    tableSet(&instance->fields, name, peek(0));
+    Value value = pop();
+    vm->stackTop[-1] = value;
+    return true;
+}
+
+bool jitIndexGet()
+{
+    Value value;
+    if (IS_LIST(peek(1)))
+    {
+        ObjList *list = AS_LIST(peek(1));
+        int slot;
+        if (!listIndex(list, peek(0), &slot))
+            return false;
+        value = list->elements.values[slot];
+    } else if (IS_MAP(peek(1)))
+    {
+        if (!valueTableGet(&AS_MAP(peek(1))->entries, peek(0), &value))
+            value = NIL_VAL;
+    } else
+    {
+        runtimeError("Only lists and maps can be indexed");
+        return false;
+    }
+    pop();
+    vm->stackTop[-1] = value;
+    return true;
+}
+
+bool jitIndexSet()
+{
+    Value value = peek(0);
+    if (IS_LIST(peek(2)))
+    {
+        ObjList *list = AS_LIST(peek(2));
+        int slot;
+        if (!listIndex(list, peek(1), &slot))
+            return false;
+        writeBarrier((Obj *)list);
+        list->elements.values[slot] = value;
+    } else if (IS_MAP(peek(2)))
+    {
+        if (!mapSet(AS_MAP(peek(2)), peek(1), value))
+            return false;
+    } else
+    {
+        runtimeError("Only lists and maps can be indexed");
+        return false;
+    }
+    vm->stackTop -= 2;
+    vm->stackTop[-1] = value;
+    return true;
+}
+
+void jitHotLoop(ObjFunction *function, int loop)
+{
+    if (vm->tierUp != NULL)
+        vm->tierUp(function, loop);
+}
+#endif
+
+// runs until the frame count drops back to baseFrame, so a call from C runs
+// just the function it called
+static InterpretResult run(int baseFrame)
+{
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    // the instruction pointer and the stack top are kept in locals, so that
+    // they can stay in registers instead of being reached through vm
+    //
+    // they are written back before anything which may collect, report an
+    // error or use the stack of the VM, and read again after anything which
+    // may change them or the running frame
+    uint8_t *ip = frame->ip;
+    Value *sp = vm->stackTop;
+#ifdef BASELINE_JIT
+    // the interpreter only looks for machine code when it can be there
+    bool jit = vm->tierUp == jitTierUp;
+#endif
+    // macros
+#define SAVE() (frame->ip = ip, vm->stackTop = sp)
+#define LOAD()                                                                 \
+    (frame = &vm->frames[vm->frameCount - 1], ip = frame->ip,                  \
+     sp = vm->stackTop)
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT()                                                        \
+    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_SHORT()                                                           \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+// do while loop is to ensure macro is hygenic
+#define BINARY_OP(valueType, op)                                               \
+    do                                                                         \
+    {                                                                          \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))                        \
+        {                                                                      \
+            SAVE();                                                            \
+            runtimeError("Operands must be numbers");                          \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        double b = AS_NUMBER(POP());                                           \
+        double a = AS_NUMBER(POP());                                           \
+        PUSH(valueType(a op b));                                               \
+    } while (false)
+#define READ_LOCAL() (frame->slots[READ_BYTE()])
+// rewrite the running instruction, which is length bytes long, into op
+//
+// code mapped from a file is read only and stays generic, so that its pages
+// are shared by every process running it
+#define QUICKEN(op, length)                                                    \
+    (frame->closure->function->chunk.mapped ? (void)0                          \
+                                            : (void)(ip[-(length)] = (op)))
+// a quickened instruction whose guess failed turns back into the generic op
+// and runs again as that, only owned code is ever quickened
+#define DEOPTIMIZE(op, length)                                                 \
+    do                                                                         \
+    {                                                                          \
+        ip[-(length)] = (op);                                                  \
+        ip -= (length);                                                        \
+    } while (false)
+// the left operand is always a local, the right one is read by readRight
+#define REGISTER_OP(valueType, op, readRight)                                  \
+    do                                                                         \
+    {                                                                          \
+        Value a = READ_LOCAL();                                                \
+        Value b = readRight;                                                   \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))                                    \
+        {                                                                      \
+            SAVE();                                                            \
+            runtimeError("Operands must be numbers");                          \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        PUSH(valueType(AS_NUMBER(a) op AS_NUMBER(b)));                         \
+    } while (false)
+// the operands live in the frame or the constants, so they are safe from GC
+#define REGISTER_ADD(readRight)                                                \
+    do                                                                         \
+    {                                                                          \
+        Value a = READ_LOCAL();                                                \
+        Value b = readRight;                                                   \
+        if (IS_NUMBER(a) && IS_NUMBER(b))                                      \
+        {                                                                      \
+            PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));                     \
+        } else if (IS_STRING(a) && IS_STRING(b))                               \
+        {                                                                      \
+            SAVE();                                                            \
+            PUSH(OBJ_VAL(concatenateStrings(AS_STRING(a), AS_STRING(b))));     \
+        } else                                                                 \
+        {                                                                      \
+            SAVE();                                                            \
+            runtimeError("Operands must be two numbers or two string");        \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+    } while (false)
+
+#ifdef BASELINE_JIT
+// a frame with machine code runs there until it calls, returns or reaches an
+// instruction the code leaves to run(), a frame without any is interpreted
+#define ENTER_NATIVE()                                                         \
+    while (jit && functionState(frame->closure->function)->native != NULL)     \
+    {                                                                          \
+        SAVE();                                                                \
+        JitExit left = jitEnter(frame);                                        \
+        if (left == JIT_ERROR)                                                 \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        if (vm->frameCount == baseFrame)                                       \
+            return INTERPRET_OK;                                               \
+        LOAD();                                                                \
+        if (left == JIT_INTERPRET)                                             \
+            break;                                                             \
+    }
+#else
+#define ENTER_NATIVE() ((void)0)
+#endif
+
+#ifdef THREADED_DISPATCH
+    // every handler jumps straight to the next one, which gives each of them
+    // its own indirect branch to predict
+    static void *dispatchTable[UINT8_COUNT] = {
+        [OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+        [OP_NIL] = &&TARGET_OP_NIL,
+        [OP_TRUE] = &&TARGET_OP_TRUE,
+        [OP_FALSE] = &&TARGET_OP_FALSE,
+        [OP_POP] = &&TARGET_OP_POP,
+        [OP_GET_UPVALUE] = &&TARGET_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&TARGET_OP_SET_UPVALUE,
+        [OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+        [OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+        [OP_SET_GLOBAL] = &&TARGET_OP_SET_GLOBAL,
+        [OP_GET_GLOBAL] = &&TARGET_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+        [OP_EQUAL] = &&TARGET_OP_EQUAL,
+        [OP_GREATER] = &&TARGET_OP_GREATER,
+        [OP_LESS] = &&TARGET_OP_LESS,
+        [OP_ADD] = &&TARGET_OP_ADD,
+        [OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+        [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+        [OP_NOT] = &&TARGET_OP_NOT,
+        [OP_NEGATE] = &&TARGET_OP_NEGATE,
+        [OP_PRINT] = &&TARGET_OP_PRINT,
+        [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&TARGET_OP_LOOP,
+        [OP_JUMP] = &&TARGET_OP_JUMP,
+        [OP_CALL] = &&TARGET_OP_CALL,
+        [OP_TAIL_CALL] = &&TARGET_OP_TAIL_CALL,
+        [OP_CLOSURE] = &&TARGET_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&TARGET_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&TARGET_OP_RETURN,
+        [OP_CLASS] = &&TARGET_OP_CLASS,
+        [OP_SET_PROPERTY] = &&TARGET_OP_SET_PROPERTY,
+        [OP_GET_PROPERTY] = &&TARGET_OP_GET_PROPERTY,
+        [OP_METHOD] = &&TARGET_OP_METHOD,
+        [OP_INVOKE] = &&TARGET_OP_INVOKE,
+        [OP_INHERIT] = &&TARGET_OP_INHERIT,
+        [OP_GET_SUPER] = &&TARGET_OP_GET_SUPER,
+        [OP_SUPER_INVOKE] = &&TARGET_OP_SUPER_INVOKE,
+        [OP_GET_METHOD] = &&TARGET_OP_GET_METHOD,
+        [OP_GET_SUPER_METHOD] = &&TARGET_OP_GET_SUPER_METHOD,
+        [OP_BIND_LOCAL] = &&TARGET_OP_BIND_LOCAL,
+        [OP_INVOKE_LOCAL] = &&TARGET_OP_INVOKE_LOCAL,
+        [OP_BUILD_LIST] = &&TARGET_OP_BUILD_LIST,
+        [OP_BUILD_MAP] = &&TARGET_OP_BUILD_MAP,
+        [OP_INDEX_GET] = &&TARGET_OP_INDEX_GET,
+        [OP_INDEX_SET] = &&TARGET_OP_INDEX_SET,
+        [OP_EQUAL_LL] = &&TARGET_OP_EQUAL_LL,
+        [OP_GREATER_LL] = &&TARGET_OP_GREATER_LL,
+        [OP_LESS_LL] = &&TARGET_OP_LESS_LL,
+        [OP_ADD_LL] = &&TARGET_OP_ADD_LL,
+        [OP_SUBTRACT_LL] = &&TARGET_OP_SUBTRACT_LL,
+        [OP_MULTIPLY_LL] = &&TARGET_OP_MULTIPLY_LL,
+        [OP_DIVIDE_LL] = &&TARGET_OP_DIVIDE_LL,
+        [OP_EQUAL_LK] = &&TARGET_OP_EQUAL_LK,
+        [OP_GREATER_LK] = &&TARGET_OP_GREATER_LK,
+        [OP_LESS_LK] = &&TARGET_OP_LESS_LK,
+        [OP_ADD_LK] = &&TARGET_OP_ADD_LK,
+        [OP_SUBTRACT_LK] = &&TARGET_OP_SUBTRACT_LK,
+        [OP_MULTIPLY_LK] = &&TARGET_OP_MULTIPLY_LK,
+        [OP_DIVIDE_LK] = &&TARGET_OP_DIVIDE_LK,
+        [OP_EQUAL_NUMBER] = &&TARGET_OP_EQUAL_NUMBER,
+        [OP_ADD_NUMBER] = &&TARGET_OP_ADD_NUMBER,
+        [OP_ADD_STRING] = &&TARGET_OP_ADD_STRING,
+        [OP_GET_FIELD] = &&TARGET_OP_GET_FIELD,
+        [OP_CALL_CLOSURE] = &&TARGET_OP_CALL_CLOSURE,
+    };
+#define CASE(op)                                                               \
+    case op:                                                                   \
+    TARGET_##op
+#define DISPATCH() goto *dispatchTable[instruction = READ_BYTE()]
+#else
+#define CASE(op) case op
+#define DISPATCH() continue
+#endif
+
+    ENTER_NATIVE();
+
+    // main loop
+    for (;;)
+    {
+#ifdef DEBUG_TRACE_EXECUTION
+        printf("          ");
+        for (Value *slot = vm->stack; slot < sp; slot++)
+        {
+            printf("[ ");
+            printValue(*slot);
+            printf(" ]");
+        }
+        printf("\n");
+        disassembleInstruction(
+            &frame->closure->function->chunk,
+            (int)(ip - frame->closure->function->chunk.code));
+#endif
+#ifdef DEBUG_CHECK_STACK
+        if (sp - frame->slots >
+            frame->closure->function->maxStackSize)
+        {
+            fprintf(stderr, "Stack depth %d exceeds the computed %d\n",
+                    (int)(sp - frame->slots),
+                    frame->closure->function->maxStackSize);
+        }
+#endif
+        uint8_t instruction;
+        // dispatchinig the instruction
+        switch (instruction = READ_BYTE())
+        {
+        CASE(OP_CONSTANT):
+        {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_PRINT):
+        {
+            printValue(POP());
+            // we dont push back value in statement
+            // statement has total stack effect fo zero
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE):
+        {
             uint16_t offset = READ_SHORT();
-            frame->ip += offset;
-            break;
+            if (isFalsey(PEEK(0)))
+                ip += offset;
+            DISPATCH();
         }
-        case OP_LOOP:
+        CASE(OP_JUMP):
         {
             uint16_t offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP):
+        {
+            uint16_t offset = READ_SHORT();
+            uint8_t loop = READ_BYTE();
+            ObjFunction *function = frame->closure->function;
+            if (countHotness(&functionState(function)->loopCounters[loop],
+                             HOT_LOOP_THRESHOLD))
+            {
+                // the backend may allocate
+                SAVE();
+                vm->tierUp(function, loop);
+            }
+            ip -= offset;
+            ENTER_NATIVE();
+            DISPATCH();
         }
-        case OP_CLOSURE:
+        CASE(OP_CLOSURE):
         {
             ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            if (function->upvalueCount == 0)
+            {
+                // nothing is captured, so there is no operand to read
+                FunctionState *state = functionState(function);
+                if (state->closure == NULL)
+                {
+                    SAVE();
+                    ObjClosure *closure = newClosure(function);
+                    // the closure is traced through the function
+                    writeBarrier((Obj *)function);
+                    state->closure = closure;
+                }
+                PUSH(OBJ_VAL(state->closure));
+                DISPATCH();
+            }
+            SAVE();
             ObjClosure *closure = newClosure(function);
-            push(OBJ_VAL(closure));
+            PUSH(OBJ_VAL(closure));
+            // the upvalues are allocated with the closure on the stack
+            SAVE();
 
             for (int i = 0; i < closure->upvalueCount; i++)
             {
@@ -402,265 +1327,1414 @@ static InterpretResult run()
                 }
             }
 
-            break;
+            DISPATCH();
         }
-        case OP_CLOSE_UPVALUE:
+        CASE(OP_CLOSE_UPVALUE):
         {
-            closeUpvalues(vm.stackTop - 1);
-            pop();
-            break;
+            SAVE();
+            closeUpvalues(sp - 1);
+            sp--;
+            DISPATCH();
         }
-        case OP_CALL:
+        CASE(OP_CALL):
         {
             // the frames for the parent calle and the function called are
             // overlapping so, same value is being reused
             int argCount = READ_BYTE();
-            if (!callValue(peek(argCount), argCount))
+            if (IS_CLOSURE(PEEK(argCount)))
+                QUICKEN(OP_CALL_CLOSURE, 2);
+            SAVE();
+            if (!callValue(PEEK(argCount), argCount))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
+            LOAD();
+            ENTER_NATIVE();
+            DISPATCH();
         }
-        case OP_RETURN:
+        CASE(OP_CALL_CLOSURE):
         {
-            Value result = pop();
-            closeUpvalues(frame->slots);
-            vm.frameCount--;
-            if (vm.frameCount == 0)
+            int argCount = READ_BYTE();
+            Value callee = PEEK(argCount);
+            if (!IS_CLOSURE(callee))
             {
-                pop();
-                return INTERPRET_OK;
+                DEOPTIMIZE(OP_CALL, 2);
+                DISPATCH();
             }
-            vm.stackTop = frame->slots;
-            push(result);
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
+            SAVE();
+            if (!call(AS_CLOSURE(callee), argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD();
+            ENTER_NATIVE();
+            DISPATCH();
         }
-        case OP_NIL:
-            push(NIL_VAL);
-            break;
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
-        case OP_POP:
-            pop();
-            break;
-        case OP_GET_UPVALUE:
+        CASE(OP_TAIL_CALL):
         {
-            uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
-            break;
+            int argCount = READ_BYTE();
+            SAVE();
+            if (!tailCall(PEEK(argCount), argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD();
+            ENTER_NATIVE();
+            DISPATCH();
         }
-        case OP_SET_UPVALUE:
+        CASE(OP_RETURN):
+        {
+            Value result = POP();
+            SAVE();
+            closeUpvalues(frame->slots);
+            vm->frameCount--;
+            sp = frame->slots;
+            PUSH(result);
+            vm->stackTop = sp;
+            // the result is left for the caller of run()
+            if (vm->frameCount == baseFrame)
+                return INTERPRET_OK;
+            LOAD();
+            ENTER_NATIVE();
+            DISPATCH();
+        }
+        CASE(OP_NIL):
+            PUSH(NIL_VAL);
+            DISPATCH();
+        CASE(OP_TRUE):
+            PUSH(BOOL_VAL(true));
+            DISPATCH();
+        CASE(OP_FALSE):
+            PUSH(BOOL_VAL(false));
+            DISPATCH();
+        CASE(OP_POP):
+            sp--;
+            DISPATCH();
+        CASE(OP_GET_UPVALUE):
         {
             uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE):
+        {
+            ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+            writeBarrier((Obj *)upvalue);
+            *upvalue->location = PEEK(0);
+            DISPATCH();
         }
-        case OP_GET_LOCAL:
+        CASE(OP_GET_LOCAL):
         {
             uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
-            break;
+            PUSH(frame->slots[slot]);
+            DISPATCH();
         }
-        case OP_SET_LOCAL:
+        CASE(OP_SET_LOCAL):
         {
             uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
-            break;
+            frame->slots[slot] = PEEK(0);
+            DISPATCH();
         }
-        case OP_SET_GLOBAL:
+        CASE(OP_SET_GLOBAL):
         {
             ObjString *name = READ_STRING();
-            if (tableSet(&vm.globals, name, peek(0)))
+            SAVE();
+            if (tableSet(&vm->globals, name, PEEK(0)))
             {
                 // tableSet automatically sets the variable so we need to ermove
                 // it for REPL
-                tableDelete(&vm.globals, name);
+                tableDelete(&vm->globals, name);
                 runtimeError("Undefined Variable '%s'", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            DISPATCH();
         }
-        case OP_GET_GLOBAL:
+        CASE(OP_GET_GLOBAL):
         {
             ObjString *name = READ_STRING();
             Value value;
-            if (!tableGet(&vm.globals, name, &value))
+            if (!tableGet(&vm->globals, name, &value))
             {
+                SAVE();
                 runtimeError("Undefined variable '%s'", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(value);
-            break;
+            PUSH(value);
+            DISPATCH();
         }
-        case OP_DEFINE_GLOBAL:
+        CASE(OP_DEFINE_GLOBAL):
         {
             ObjString *name = READ_STRING();
-            tableSet(&vm.globals, name, peek(0));
-            pop();
-            break;
+            SAVE();
+            tableSet(&vm->globals, name, PEEK(0));
+            sp--;
+            DISPATCH();
         }
-        case OP_EQUAL:
+        CASE(OP_EQUAL):
         {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
-            break;
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+                QUICKEN(OP_EQUAL_NUMBER, 1);
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_EQUAL_NUMBER):
+        {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+            {
+                DEOPTIMIZE(OP_EQUAL, 1);
+                DISPATCH();
+            }
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(POP());
+            PUSH(BOOL_VAL(a == b));
+            DISPATCH();
         }
-        case OP_GREATER:
+        CASE(OP_GREATER):
             BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
+            DISPATCH();
+        CASE(OP_LESS):
             BINARY_OP(BOOL_VAL, <);
-            break;
-        case OP_ADD:
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            DISPATCH();
+        CASE(OP_ADD):
+            if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1)))
             {
+                QUICKEN(OP_ADD_STRING, 1);
+                SAVE();
                 concatenate();
-            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+                LOAD();
+            } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
             {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+                QUICKEN(OP_ADD_NUMBER, 1);
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
             } else
             {
+                SAVE();
                 runtimeError("Operands must be two numbers or two string");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
-            break;
-        case OP_SUBTRACT:
+            DISPATCH();
+        CASE(OP_ADD_NUMBER):
+        {
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+            {
+                DEOPTIMIZE(OP_ADD, 1);
+                DISPATCH();
+            }
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(POP());
+            PUSH(NUMBER_VAL(a + b));
+            DISPATCH();
+        }
+        CASE(OP_ADD_STRING):
+            if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1)))
+            {
+                DEOPTIMIZE(OP_ADD, 1);
+                DISPATCH();
+            }
+            SAVE();
+            concatenate();
+            LOAD();
+            DISPATCH();
+        CASE(OP_SUBTRACT):
             BINARY_OP(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
+            DISPATCH();
+        CASE(OP_MULTIPLY):
             BINARY_OP(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
+            DISPATCH();
+        CASE(OP_DIVIDE):
             BINARY_OP(NUMBER_VAL, /);
-            break;
-        case OP_NOT:
-            push(BOOL_VAL(isFalsey(pop())));
-            break;
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(0)))
+            DISPATCH();
+        CASE(OP_EQUAL_LL):
+        {
+            Value a = READ_LOCAL();
+            Value b = READ_LOCAL();
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER_LL):
+            REGISTER_OP(BOOL_VAL, >, READ_LOCAL());
+            DISPATCH();
+        CASE(OP_LESS_LL):
+            REGISTER_OP(BOOL_VAL, <, READ_LOCAL());
+            DISPATCH();
+        CASE(OP_ADD_LL):
+            REGISTER_ADD(READ_LOCAL());
+            DISPATCH();
+        CASE(OP_SUBTRACT_LL):
+            REGISTER_OP(NUMBER_VAL, -, READ_LOCAL());
+            DISPATCH();
+        CASE(OP_MULTIPLY_LL):
+            REGISTER_OP(NUMBER_VAL, *, READ_LOCAL());
+            DISPATCH();
+        CASE(OP_DIVIDE_LL):
+            REGISTER_OP(NUMBER_VAL, /, READ_LOCAL());
+            DISPATCH();
+        CASE(OP_EQUAL_LK):
+        {
+            Value a = READ_LOCAL();
+            Value b = READ_CONSTANT();
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER_LK):
+            REGISTER_OP(BOOL_VAL, >, READ_CONSTANT());
+            DISPATCH();
+        CASE(OP_LESS_LK):
+            REGISTER_OP(BOOL_VAL, <, READ_CONSTANT());
+            DISPATCH();
+        CASE(OP_ADD_LK):
+            REGISTER_ADD(READ_CONSTANT());
+            DISPATCH();
+        CASE(OP_SUBTRACT_LK):
+            REGISTER_OP(NUMBER_VAL, -, READ_CONSTANT());
+            DISPATCH();
+        CASE(OP_MULTIPLY_LK):
+            REGISTER_OP(NUMBER_VAL, *, READ_CONSTANT());
+            DISPATCH();
+        CASE(OP_DIVIDE_LK):
+            REGISTER_OP(NUMBER_VAL, /, READ_CONSTANT());
+            DISPATCH();
+        CASE(OP_NOT):
+            sp[-1] = BOOL_VAL(isFalsey(PEEK(0)));
+            DISPATCH();
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(PEEK(0)))
             {
+                SAVE();
                 runtimeError("Operand must be a number");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        case OP_CLASS:
-            push(OBJ_VAL(newClass(READ_STRING())));
-            break;
-        case OP_GET_PROPERTY:
+            sp[-1] = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        CASE(OP_CLASS):
+            SAVE();
+            PUSH(OBJ_VAL(newClass(READ_STRING())));
+            DISPATCH();
+        CASE(OP_GET_PROPERTY):
         {
-            if (!IS_INSTANCE(peek(0)))
+            if (!IS_INSTANCE(PEEK(0)))
             {
+                SAVE();
                 runtimeError("Only instances have properties");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            ObjInstance *instance = AS_INSTANCE(peek(0));
+            ObjInstance *instance = AS_INSTANCE(PEEK(0));
             ObjString *name = READ_STRING();
             Value value;
             if (tableGet(&instance->fields, name, &value))
             {
-                pop(); // instance
-                push(value);
-                break;
+                QUICKEN(OP_GET_FIELD, 2);
+                sp--; // instance
+                PUSH(value);
+                DISPATCH();
             }
+            SAVE();
             if (!bindMethod(instance->klass, name))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            LOAD();
+            DISPATCH();
+        }
+        CASE(OP_GET_FIELD):
+        {
+            ObjString *name = READ_STRING();
+            Value value;
+            if (!IS_INSTANCE(PEEK(0)) ||
+                !tableGet(&AS_INSTANCE(PEEK(0))->fields, name, &value))
+            {
+                DEOPTIMIZE(OP_GET_PROPERTY, 2);
+                DISPATCH();
+            }
+            sp--; // instance
+            PUSH(value);
+            DISPATCH();
         }
-        case OP_SET_PROPERTY:
+        CASE(OP_SET_PROPERTY):
         {
-            if (!IS_INSTANCE(peek(1)))
+            if (!IS_INSTANCE(PEEK(1)))
             {
+                SAVE();
                 runtimeError("Only instances have fields");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            ObjInstance *instance = AS_INSTANCE(peek(1));
-            tableSet(&instance->fields, READ_STRING(), peek(0));
-            Value value = pop();
-            pop();
-            push(value);
-            break;
+            ObjInstance *instance = AS_INSTANCE(PEEK(1));
+            writeBarrier((Obj *)instance);
+            SAVE();
+            tableSet(&instance->fields, READ_STRING(), PEEK(0));
+            Value value = POP();
+            sp--;
+            PUSH(value);
+            DISPATCH();
         }
-        case OP_METHOD:
-            defineMethod(READ_STRING());
-            break;
-        case OP_INVOKE:
+        CASE(OP_METHOD):
+        {
+            ObjString *name = READ_STRING();
+            SAVE();
+            defineMethod(name);
+            LOAD();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE):
         {
             ObjString *method = READ_STRING();
             int argCount = READ_BYTE();
+            SAVE();
             if (!invoke(method, argCount))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
+            LOAD();
+            ENTER_NATIVE();
+            DISPATCH();
         }
-        case OP_INHERIT:
+        CASE(OP_INHERIT):
         {
-            Value superclass = peek(1);
+            Value superclass = PEEK(1);
 
             if (!IS_CLASS(superclass))
             {
+                SAVE();
                 runtimeError("Superclass must be a class");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            ObjClass *subclass = AS_CLASS(peek(0));
+            ObjClass *subclass = AS_CLASS(PEEK(0));
             // methods in subclass will override the methods copied from
-            // superclass
-            tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-            pop(); // subclass
-            break;
+            // superclass, all vtables share the slot numbering so the copy is
+            // a plain array copy
+            ValueArray *methods = &AS_CLASS(superclass)->methods;
+            SAVE();
+            reserveMethodSlot(subclass, methods->count - 1);
+            writeBarrier((Obj *)subclass);
+            for (int i = 0; i < methods->count; i++)
+            {
+                if (!IS_NIL(methods->values[i]))
+                    subclass->methods.values[i] = methods->values[i];
+            }
+            sp--; // subclass
+            DISPATCH();
         }
-        case OP_GET_SUPER:
+        CASE(OP_GET_SUPER):
         {
             ObjString *name = READ_STRING();
-            ObjClass *superclass = AS_CLASS(pop());
+            ObjClass *superclass = AS_CLASS(POP());
             // superclass is sitting on top of the stack
+            SAVE();
             if (!bindMethod(superclass, name))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            LOAD();
+            DISPATCH();
         }
-        case OP_SUPER_INVOKE:
+        CASE(OP_SUPER_INVOKE):
         {
             ObjString *method = READ_STRING();
             int argCount = READ_BYTE();
-            ObjClass *superclass = AS_CLASS(pop());
+            ObjClass *superclass = AS_CLASS(POP());
+            SAVE();
             if (!invokeFromClass(superclass, method, argCount))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
-        }
+            LOAD();
+            ENTER_NATIVE();
+            DISPATCH();
         }
-    }
-#undef READ_BYTE
-#undef READ_CONSTANT
-#undef READ_STRING
-#undef READ_SHORT
-#undef BINARY_OP
-}
-
-InterpretResult interpret(const char *source)
+        CASE(OP_GET_METHOD):
+        {
+            if (!IS_INSTANCE(PEEK(0)))
+            {
+                SAVE();
+                runtimeError("Only instances have properties");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjInstance *instance = AS_INSTANCE(PEEK(0));
+            ObjString *name = READ_STRING();
+            Value value;
+            if (tableGet(&instance->fields, name, &value))
+            {
+                sp[-1] = NIL_VAL;
+                PUSH(value);
+                DISPATCH();
+            }
+            SAVE();
+            if (!getMethod(instance->klass, name))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD();
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER_METHOD):
+        {
+            ObjString *name = READ_STRING();
+            ObjClass *superclass = AS_CLASS(POP());
+            SAVE();
+            if (!getMethod(superclass, name))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD();
+            DISPATCH();
+        }
+        CASE(OP_BIND_LOCAL):
+        {
+            uint8_t slot = READ_BYTE();
+            SAVE();
+            PUSH(bindLocal(&frame->slots[slot]));
+            DISPATCH();
+        }
+        CASE(OP_INVOKE_LOCAL):
+        {
+            // the receiver (or nil) was pushed in place of the callee
+            Value method = frame->slots[READ_BYTE()];
+            int argCount = READ_BYTE();
+            SAVE();
+            if (IS_NIL(PEEK(argCount)))
+            {
+                sp[-argCount - 1] = method;
+                if (!callValue(method, argCount))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+            } else if (!call(AS_CLOSURE(method), argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD();
+            ENTER_NATIVE();
+            DISPATCH();
+        }
+        CASE(OP_BUILD_LIST):
+        {
+            int count = READ_BYTE();
+            // the elements stay on the stack until they are copied, and the
+            // list is sized once for all of them
+            SAVE();
+            ObjList *list = newList();
+            PUSH(OBJ_VAL(list));
+            SAVE();
+            list->elements.values = ALLOCATE(Value, count);
+            list->elements.capacity = count;
+            if (count > 0)
+                memcpy(list->elements.values, sp - count - 1,
+                       sizeof(Value) * count);
+            list->elements.count = count;
+            sp -= count + 1;
+            PUSH(OBJ_VAL(list));
+            DISPATCH();
+        }
+        CASE(OP_BUILD_MAP):
+        {
+            int count = READ_BYTE();
+            // the pairs stay on the stack, and safe from GC, until the map
+            // holds them
+            SAVE();
+            ObjMap *map = newMap();
+            PUSH(OBJ_VAL(map));
+            SAVE();
+            Value *pairs = sp - 2 * count - 1;
+            for (int i = 0; i < count; i++)
+            {
+                if (!mapSet(map, pairs[2 * i], pairs[2 * i + 1]))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+            }
+            sp = pairs;
+            PUSH(OBJ_VAL(map));
+            DISPATCH();
+        }
+        CASE(OP_INDEX_GET):
+        {
+            Value value;
+            if (IS_LIST(PEEK(1)))
+            {
+                ObjList *list = AS_LIST(PEEK(1));
+                int slot;
+                SAVE();
+                if (!listIndex(list, PEEK(0), &slot))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                value = list->elements.values[slot];
+            } else if (IS_MAP(PEEK(1)))
+            {
+                // a missing key reads as nil
+                if (!valueTableGet(&AS_MAP(PEEK(1))->entries, PEEK(0), &value))
+                    value = NIL_VAL;
+            } else
+            {
+                SAVE();
+                runtimeError("Only lists and maps can be indexed");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            sp--;
+            sp[-1] = value;
+            DISPATCH();
+        }
+        CASE(OP_INDEX_SET):
+        {
+            Value value = PEEK(0);
+            if (IS_LIST(PEEK(2)))
+            {
+                ObjList *list = AS_LIST(PEEK(2));
+                int slot;
+                SAVE();
+                if (!listIndex(list, PEEK(1), &slot))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                writeBarrier((Obj *)list);
+                list->elements.values[slot] = value;
+            } else if (IS_MAP(PEEK(2)))
+            {
+                // the map, key and value are still on the stack if the map
+                // grows and collects
+                SAVE();
+                if (!mapSet(AS_MAP(PEEK(2)), PEEK(1), value))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+            } else
+            {
+                SAVE();
+                runtimeError("Only lists and maps can be indexed");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            sp -= 2;
+            sp[-1] = value;
+            DISPATCH();
+        }
+        }
+    }
+#undef SAVE
+#undef LOAD
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef READ_BYTE
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_SHORT
+#undef BINARY_OP
+#undef READ_LOCAL
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef REGISTER_OP
+#undef REGISTER_ADD
+#undef ENTER_NATIVE
+#undef CASE
+#undef DISPATCH
+}
+
+// runs the register translation of the frames above baseFrame, the register
+// machine counterpart of run()
+//
+// the registers of a frame are its stack slots, so calls, upvalues and the
+// GC see the same layout as in run(), and vm->stackTop stays above all of
+// them except while an instruction hands the values from some register up to
+// the stack helpers
+static InterpretResult runRegisters(int baseFrame)
 {
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *regs;
+    // macros
+#define SAVE() (frame->ip = ip)
+#define LOAD()                                                                 \
+    (frame = &vm->frames[vm->frameCount - 1], ip = frame->ip,                  \
+     regs = frame->slots,                                                      \
+     vm->stackTop = regs + frame->closure->function->maxStackSize)
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT()                                                        \
+    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_SHORT()                                                           \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define R(index) (regs[index])
+// a call may have pushed a frame running stack code, which run() takes to its
+// return before the caller goes on
+//
+// after a tail call there may be nothing of this run left to go back to
+#define ENTER()                                                                \
+    do                                                                         \
+    {                                                                          \
+        frame = &vm->frames[vm->frameCount - 1];                               \
+        if (frameChunk(frame) !=                                               \
+            &functionState(frame->closure->function)->registers)               \
+        {                                                                      \
+            InterpretResult result = run(vm->frameCount - 1);                  \
+            if (result != INTERPRET_OK || vm->frameCount == baseFrame)         \
+                return result;                                                 \
+        }                                                                      \
+        LOAD();                                                                \
+    } while (false)
+// the left operand is a register, the right one is read by readRight
+#define NUMBER_OP(valueType, op, readRight)                                    \
+    do                                                                         \
+    {                                                                          \
+        uint8_t dest = READ_BYTE();                                            \
+        Value a = R(READ_BYTE());                                              \
+        Value b = readRight;                                                   \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))                                    \
+        {                                                                      \
+            SAVE();                                                            \
+            runtimeError("Operands must be numbers");                          \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        R(dest) = valueType(AS_NUMBER(a) op AS_NUMBER(b));                     \
+    } while (false)
+// the operands live in registers or the constants, so they are safe from GC
+#define ADD_OP(readRight)                                                      \
+    do                                                                         \
+    {                                                                          \
+        uint8_t dest = READ_BYTE();                                            \
+        Value a = R(READ_BYTE());                                              \
+        Value b = readRight;                                                   \
+        if (IS_NUMBER(a) && IS_NUMBER(b))                                      \
+        {                                                                      \
+            R(dest) = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));                 \
+        } else if (IS_STRING(a) && IS_STRING(b))                               \
+        {                                                                      \
+            SAVE();                                                            \
+            R(dest) =                                                          \
+                OBJ_VAL(concatenateStrings(AS_STRING(a), AS_STRING(b)));       \
+        } else                                                                 \
+        {                                                                      \
+            SAVE();                                                            \
+            runtimeError("Operands must be two numbers or two string");        \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+    } while (false)
+#define EQUAL_OP(readRight)                                                    \
+    do                                                                         \
+    {                                                                          \
+        uint8_t dest = READ_BYTE();                                            \
+        Value a = R(READ_BYTE());                                              \
+        R(dest) = BOOL_VAL(valuesEqual(a, readRight));                         \
+    } while (false)
+// a comparison of numbers which jumps when it is false
+#define JUMP_UNLESS(op, readRight)                                             \
+    do                                                                         \
+    {                                                                          \
+        Value a = R(READ_BYTE());                                              \
+        Value b = readRight;                                                   \
+        uint16_t offset = READ_SHORT();                                        \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))                                    \
+        {                                                                      \
+            SAVE();                                                            \
+            runtimeError("Operands must be numbers");                          \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        if (!(AS_NUMBER(a) op AS_NUMBER(b)))                                   \
+            ip += offset;                                                      \
+    } while (false)
+#define JUMP_UNLESS_EQUAL(readRight)                                           \
+    do                                                                         \
+    {                                                                          \
+        Value a = R(READ_BYTE());                                              \
+        Value b = readRight;                                                   \
+        uint16_t offset = READ_SHORT();                                        \
+        if (!valuesEqual(a, b))                                                \
+            ip += offset;                                                      \
+    } while (false)
+
+#ifdef THREADED_DISPATCH
+    static void *dispatchTable[UINT8_COUNT] = {
+        [REG_MOVE] = &&TARGET_REG_MOVE,
+        [REG_CONSTANT] = &&TARGET_REG_CONSTANT,
+        [REG_NIL] = &&TARGET_REG_NIL,
+        [REG_TRUE] = &&TARGET_REG_TRUE,
+        [REG_FALSE] = &&TARGET_REG_FALSE,
+        [REG_GET_UPVALUE] = &&TARGET_REG_GET_UPVALUE,
+        [REG_SET_UPVALUE] = &&TARGET_REG_SET_UPVALUE,
+        [REG_GET_GLOBAL] = &&TARGET_REG_GET_GLOBAL,
+        [REG_SET_GLOBAL] = &&TARGET_REG_SET_GLOBAL,
+        [REG_DEFINE_GLOBAL] = &&TARGET_REG_DEFINE_GLOBAL,
+        [REG_EQUAL] = &&TARGET_REG_EQUAL,
+        [REG_GREATER] = &&TARGET_REG_GREATER,
+        [REG_LESS] = &&TARGET_REG_LESS,
+        [REG_ADD] = &&TARGET_REG_ADD,
+        [REG_SUBTRACT] = &&TARGET_REG_SUBTRACT,
+        [REG_MULTIPLY] = &&TARGET_REG_MULTIPLY,
+        [REG_DIVIDE] = &&TARGET_REG_DIVIDE,
+        [REG_EQUAL_K] = &&TARGET_REG_EQUAL_K,
+        [REG_GREATER_K] = &&TARGET_REG_GREATER_K,
+        [REG_LESS_K] = &&TARGET_REG_LESS_K,
+        [REG_ADD_K] = &&TARGET_REG_ADD_K,
+        [REG_SUBTRACT_K] = &&TARGET_REG_SUBTRACT_K,
+        [REG_MULTIPLY_K] = &&TARGET_REG_MULTIPLY_K,
+        [REG_DIVIDE_K] = &&TARGET_REG_DIVIDE_K,
+        [REG_NOT] = &&TARGET_REG_NOT,
+        [REG_NEGATE] = &&TARGET_REG_NEGATE,
+        [REG_PRINT] = &&TARGET_REG_PRINT,
+        [REG_JUMP] = &&TARGET_REG_JUMP,
+        [REG_JUMP_IF_FALSE] = &&TARGET_REG_JUMP_IF_FALSE,
+        [REG_LOOP] = &&TARGET_REG_LOOP,
+        [REG_JUMP_UNLESS_EQUAL] = &&TARGET_REG_JUMP_UNLESS_EQUAL,
+        [REG_JUMP_UNLESS_GREATER] = &&TARGET_REG_JUMP_UNLESS_GREATER,
+        [REG_JUMP_UNLESS_LESS] = &&TARGET_REG_JUMP_UNLESS_LESS,
+        [REG_JUMP_UNLESS_EQUAL_K] = &&TARGET_REG_JUMP_UNLESS_EQUAL_K,
+        [REG_JUMP_UNLESS_GREATER_K] = &&TARGET_REG_JUMP_UNLESS_GREATER_K,
+        [REG_JUMP_UNLESS_LESS_K] = &&TARGET_REG_JUMP_UNLESS_LESS_K,
+        [REG_RETURN] = &&TARGET_REG_RETURN,
+        [REG_CLOSE_UPVALUE] = &&TARGET_REG_CLOSE_UPVALUE,
+        [REG_CLOSURE] = &&TARGET_REG_CLOSURE,
+        [REG_CLASS] = &&TARGET_REG_CLASS,
+        [REG_GET_PROPERTY] = &&TARGET_REG_GET_PROPERTY,
+        [REG_SET_PROPERTY] = &&TARGET_REG_SET_PROPERTY,
+        [REG_INDEX_GET] = &&TARGET_REG_INDEX_GET,
+        [REG_INDEX_SET] = &&TARGET_REG_INDEX_SET,
+        [REG_BIND_LOCAL] = &&TARGET_REG_BIND_LOCAL,
+        [REG_CALL] = &&TARGET_REG_CALL,
+        [REG_TAIL_CALL] = &&TARGET_REG_TAIL_CALL,
+        [REG_INVOKE] = &&TARGET_REG_INVOKE,
+        [REG_SUPER_INVOKE] = &&TARGET_REG_SUPER_INVOKE,
+        [REG_INVOKE_LOCAL] = &&TARGET_REG_INVOKE_LOCAL,
+        [REG_METHOD] = &&TARGET_REG_METHOD,
+        [REG_INHERIT] = &&TARGET_REG_INHERIT,
+        [REG_GET_SUPER] = &&TARGET_REG_GET_SUPER,
+        [REG_GET_METHOD] = &&TARGET_REG_GET_METHOD,
+        [REG_GET_SUPER_METHOD] = &&TARGET_REG_GET_SUPER_METHOD,
+        [REG_BUILD_LIST] = &&TARGET_REG_BUILD_LIST,
+        [REG_BUILD_MAP] = &&TARGET_REG_BUILD_MAP,
+    };
+#define CASE(op)                                                               \
+    case op:                                                                   \
+    TARGET_##op
+#define DISPATCH() goto *dispatchTable[instruction = READ_BYTE()]
+#else
+#define CASE(op) case op
+#define DISPATCH() continue
+#endif
+
+    LOAD();
+    // main loop
+    for (;;)
+    {
+#ifdef DEBUG_TRACE_EXECUTION
+        printf("          ");
+        for (Value *slot = regs; slot < vm->stackTop; slot++)
+        {
+            printf("[ ");
+            printValue(*slot);
+            printf(" ]");
+        }
+        printf("\n");
+        ObjFunction *running = frame->closure->function;
+        disassembleRegisterInstruction(
+            running, (int)(ip - functionState(running)->registers.code));
+#endif
+        uint8_t instruction;
+        switch (instruction = READ_BYTE())
+        {
+        CASE(REG_MOVE):
+        {
+            uint8_t dest = READ_BYTE();
+            R(dest) = R(READ_BYTE());
+            DISPATCH();
+        }
+        CASE(REG_CONSTANT):
+        {
+            uint8_t dest = READ_BYTE();
+            R(dest) = READ_CONSTANT();
+            DISPATCH();
+        }
+        CASE(REG_NIL):
+            R(READ_BYTE()) = NIL_VAL;
+            DISPATCH();
+        CASE(REG_TRUE):
+            R(READ_BYTE()) = BOOL_VAL(true);
+            DISPATCH();
+        CASE(REG_FALSE):
+            R(READ_BYTE()) = BOOL_VAL(false);
+            DISPATCH();
+        CASE(REG_GET_UPVALUE):
+        {
+            uint8_t dest = READ_BYTE();
+            R(dest) = *frame->closure->upvalues[READ_BYTE()]->location;
+            DISPATCH();
+        }
+        CASE(REG_SET_UPVALUE):
+        {
+            ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+            writeBarrier((Obj *)upvalue);
+            *upvalue->location = R(READ_BYTE());
+            DISPATCH();
+        }
+        CASE(REG_GET_GLOBAL):
+        {
+            uint8_t dest = READ_BYTE();
+            ObjString *name = READ_STRING();
+            Value value;
+            if (!tableGet(&vm->globals, name, &value))
+            {
+                SAVE();
+                runtimeError("Undefined variable '%s'", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            R(dest) = value;
+            DISPATCH();
+        }
+        CASE(REG_SET_GLOBAL):
+        {
+            ObjString *name = READ_STRING();
+            Value value = R(READ_BYTE());
+            SAVE();
+            if (tableSet(&vm->globals, name, value))
+            {
+                tableDelete(&vm->globals, name);
+                runtimeError("Undefined Variable '%s'", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(REG_DEFINE_GLOBAL):
+        {
+            ObjString *name = READ_STRING();
+            Value value = R(READ_BYTE());
+            SAVE();
+            tableSet(&vm->globals, name, value);
+            DISPATCH();
+        }
+        CASE(REG_EQUAL):
+            EQUAL_OP(R(READ_BYTE()));
+            DISPATCH();
+        CASE(REG_GREATER):
+            NUMBER_OP(BOOL_VAL, >, R(READ_BYTE()));
+            DISPATCH();
+        CASE(REG_LESS):
+            NUMBER_OP(BOOL_VAL, <, R(READ_BYTE()));
+            DISPATCH();
+        CASE(REG_ADD):
+            ADD_OP(R(READ_BYTE()));
+            DISPATCH();
+        CASE(REG_SUBTRACT):
+            NUMBER_OP(NUMBER_VAL, -, R(READ_BYTE()));
+            DISPATCH();
+        CASE(REG_MULTIPLY):
+            NUMBER_OP(NUMBER_VAL, *, R(READ_BYTE()));
+            DISPATCH();
+        CASE(REG_DIVIDE):
+            NUMBER_OP(NUMBER_VAL, /, R(READ_BYTE()));
+            DISPATCH();
+        CASE(REG_EQUAL_K):
+            EQUAL_OP(READ_CONSTANT());
+            DISPATCH();
+        CASE(REG_GREATER_K):
+            NUMBER_OP(BOOL_VAL, >, READ_CONSTANT());
+            DISPATCH();
+        CASE(REG_LESS_K):
+            NUMBER_OP(BOOL_VAL, <, READ_CONSTANT());
+            DISPATCH();
+        CASE(REG_ADD_K):
+            ADD_OP(READ_CONSTANT());
+            DISPATCH();
+        CASE(REG_SUBTRACT_K):
+            NUMBER_OP(NUMBER_VAL, -, READ_CONSTANT());
+            DISPATCH();
+        CASE(REG_MULTIPLY_K):
+            NUMBER_OP(NUMBER_VAL, *, READ_CONSTANT());
+            DISPATCH();
+        CASE(REG_DIVIDE_K):
+            NUMBER_OP(NUMBER_VAL, /, READ_CONSTANT());
+            DISPATCH();
+        CASE(REG_NOT):
+        {
+            uint8_t dest = READ_BYTE();
+            R(dest) = BOOL_VAL(isFalsey(R(READ_BYTE())));
+            DISPATCH();
+        }
+        CASE(REG_NEGATE):
+        {
+            uint8_t dest = READ_BYTE();
+            Value value = R(READ_BYTE());
+            if (!IS_NUMBER(value))
+            {
+                SAVE();
+                runtimeError("Operand must be a number");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            R(dest) = NUMBER_VAL(-AS_NUMBER(value));
+            DISPATCH();
+        }
+        CASE(REG_PRINT):
+            printValue(R(READ_BYTE()));
+            printf("\n");
+            DISPATCH();
+        CASE(REG_JUMP):
+        {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(REG_JUMP_IF_FALSE):
+        {
+            Value condition = R(READ_BYTE());
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(condition))
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(REG_LOOP):
+        {
+            uint16_t offset = READ_SHORT();
+            uint8_t loop = READ_BYTE();
+            ObjFunction *function = frame->closure->function;
+            if (countHotness(&functionState(function)->loopCounters[loop],
+                             HOT_LOOP_THRESHOLD))
+            {
+                SAVE();
+                vm->tierUp(function, loop);
+            }
+            ip -= offset;
+            DISPATCH();
+        }
+        CASE(REG_JUMP_UNLESS_EQUAL):
+            JUMP_UNLESS_EQUAL(R(READ_BYTE()));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_GREATER):
+            JUMP_UNLESS(>, R(READ_BYTE()));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_LESS):
+            JUMP_UNLESS(<, R(READ_BYTE()));
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_EQUAL_K):
+            JUMP_UNLESS_EQUAL(READ_CONSTANT());
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_GREATER_K):
+            JUMP_UNLESS(>, READ_CONSTANT());
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_LESS_K):
+            JUMP_UNLESS(<, READ_CONSTANT());
+            DISPATCH();
+        CASE(REG_RETURN):
+        {
+            Value result = R(READ_BYTE());
+            closeUpvalues(frame->slots);
+            vm->frameCount--;
+            frame->slots[0] = result;
+            vm->stackTop = frame->slots + 1;
+            // the result is left for the caller of runRegisters()
+            if (vm->frameCount == baseFrame)
+                return INTERPRET_OK;
+            LOAD();
+            DISPATCH();
+        }
+        CASE(REG_CLOSE_UPVALUE):
+            closeUpvalues(&R(READ_BYTE()));
+            DISPATCH();
+        CASE(REG_CLOSURE):
+        {
+            uint8_t dest = READ_BYTE();
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            if (function->upvalueCount == 0)
+            {
+                FunctionState *state = functionState(function);
+                if (state->closure == NULL)
+                {
+                    SAVE();
+                    ObjClosure *closure = newClosure(function);
+                    // the closure is traced through the function
+                    writeBarrier((Obj *)function);
+                    state->closure = closure;
+                }
+                R(dest) = OBJ_VAL(state->closure);
+                DISPATCH();
+            }
+            SAVE();
+            ObjClosure *closure = newClosure(function);
+            // the upvalues are allocated with the closure in its register
+            R(dest) = OBJ_VAL(closure);
+            for (int i = 0; i < closure->upvalueCount; i++)
+            {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal)
+                {
+                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                } else
+                {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
+                }
+            }
+            DISPATCH();
+        }
+        CASE(REG_CLASS):
+        {
+            uint8_t dest = READ_BYTE();
+            ObjString *name = READ_STRING();
+            SAVE();
+            R(dest) = OBJ_VAL(newClass(name));
+            DISPATCH();
+        }
+        CASE(REG_GET_PROPERTY):
+        {
+            uint8_t dest = READ_BYTE();
+            Value receiver = R(READ_BYTE());
+            ObjString *name = READ_STRING();
+            if (!IS_INSTANCE(receiver))
+            {
+                SAVE();
+                runtimeError("Only instances have properties");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjInstance *instance = AS_INSTANCE(receiver);
+            Value value;
+            if (tableGet(&instance->fields, name, &value))
+            {
+                R(dest) = value;
+                DISPATCH();
+            }
+            SAVE();
+            if (!findMethod(instance->klass, name, &value))
+            {
+                runtimeError("Undefined property '%s'", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            // the receiver is still in its register
+            R(dest) = OBJ_VAL(newBoundMethod(receiver, AS_CLOSURE(value)));
+            DISPATCH();
+        }
+        CASE(REG_SET_PROPERTY):
+        {
+            uint8_t dest = READ_BYTE();
+            Value receiver = R(READ_BYTE());
+            ObjString *name = READ_STRING();
+            Value value = R(READ_BYTE());
+            SAVE();
+            if (!IS_INSTANCE(receiver))
+            {
+                runtimeError("Only instances have fields");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjInstance *instance = AS_INSTANCE(receiver);
+            writeBarrier((Obj *)instance);
+            tableSet(&instance->fields, name, value);
+            R(dest) = value;
+            DISPATCH();
+        }
+        CASE(REG_INDEX_GET):
+        {
+            uint8_t dest = READ_BYTE();
+            Value object = R(READ_BYTE());
+            Value index = R(READ_BYTE());
+            Value value;
+            if (IS_LIST(object))
+            {
+                ObjList *list = AS_LIST(object);
+                int slot;
+                SAVE();
+                if (!listIndex(list, index, &slot))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                value = list->elements.values[slot];
+            } else if (IS_MAP(object))
+            {
+                // a missing key reads as nil
+                if (!valueTableGet(&AS_MAP(object)->entries, index, &value))
+                    value = NIL_VAL;
+            } else
+            {
+                SAVE();
+                runtimeError("Only lists and maps can be indexed");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            R(dest) = value;
+            DISPATCH();
+        }
+        CASE(REG_INDEX_SET):
+        {
+            uint8_t dest = READ_BYTE();
+            Value object = R(READ_BYTE());
+            Value index = R(READ_BYTE());
+            Value value = R(READ_BYTE());
+            SAVE();
+            if (IS_LIST(object))
+            {
+                ObjList *list = AS_LIST(object);
+                int slot;
+                if (!listIndex(list, index, &slot))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                writeBarrier((Obj *)list);
+                list->elements.values[slot] = value;
+            } else if (IS_MAP(object))
+            {
+                if (!mapSet(AS_MAP(object), index, value))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+            } else
+            {
+                runtimeError("Only lists and maps can be indexed");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            R(dest) = value;
+            DISPATCH();
+        }
+        CASE(REG_BIND_LOCAL):
+        {
+            uint8_t dest = READ_BYTE();
+            uint8_t slot = READ_BYTE();
+            SAVE();
+            Value value = bindLocal(&R(slot));
+            R(dest) = value;
+            DISPATCH();
+        }
+        CASE(REG_CALL):
+        {
+            uint8_t base = READ_BYTE();
+            int argCount = READ_BYTE();
+            vm->stackTop = &R(base + argCount + 1);
+            SAVE();
+            if (!callValue(R(base), argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER();
+            DISPATCH();
+        }
+        CASE(REG_TAIL_CALL):
+        {
+            uint8_t base = READ_BYTE();
+            int argCount = READ_BYTE();
+            vm->stackTop = &R(base + argCount + 1);
+            SAVE();
+            if (!tailCall(R(base), argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER();
+            DISPATCH();
+        }
+        CASE(REG_INVOKE):
+        {
+            uint8_t base = READ_BYTE();
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            vm->stackTop = &R(base + argCount + 1);
+            SAVE();
+            if (!invoke(method, argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER();
+            DISPATCH();
+        }
+        CASE(REG_SUPER_INVOKE):
+        {
+            uint8_t base = READ_BYTE();
+            ObjString *method = READ_STRING();
+            int argCount = READ_BYTE();
+            // the superclass is above the arguments
+            ObjClass *superclass = AS_CLASS(R(base + argCount + 1));
+            vm->stackTop = &R(base + argCount + 1);
+            SAVE();
+            if (!invokeFromClass(superclass, method, argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER();
+            DISPATCH();
+        }
+        CASE(REG_INVOKE_LOCAL):
+        {
+            // the receiver (or nil) was put in place of the callee
+            uint8_t base = READ_BYTE();
+            Value method = R(READ_BYTE());
+            int argCount = READ_BYTE();
+            vm->stackTop = &R(base + argCount + 1);
+            SAVE();
+            if (IS_NIL(R(base)))
+            {
+                R(base) = method;
+                if (!callValue(method, argCount))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+            } else if (!call(AS_CLOSURE(method), argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ENTER();
+            DISPATCH();
+        }
+        CASE(REG_METHOD):
+        {
+            uint8_t base = READ_BYTE();
+            ObjString *name = READ_STRING();
+            vm->stackTop = &R(base + 2);
+            SAVE();
+            defineMethod(name);
+            LOAD();
+            DISPATCH();
+        }
+        CASE(REG_INHERIT):
+        {
+            uint8_t base = READ_BYTE();
+            Value superclass = R(base);
+            SAVE();
+            if (!IS_CLASS(superclass))
+            {
+                runtimeError("Superclass must be a class");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjClass *subclass = AS_CLASS(R(base + 1));
+            ValueArray *methods = &AS_CLASS(superclass)->methods;
+            reserveMethodSlot(subclass, methods->count - 1);
+            writeBarrier((Obj *)subclass);
+            for (int i = 0; i < methods->count; i++)
+            {
+                if (!IS_NIL(methods->values[i]))
+                    subclass->methods.values[i] = methods->values[i];
+            }
+            DISPATCH();
+        }
+        CASE(REG_GET_SUPER):
+        {
+            uint8_t base = READ_BYTE();
+            ObjString *name = READ_STRING();
+            // the receiver is bound on top of the stack, below the superclass
+            ObjClass *superclass = AS_CLASS(R(base + 1));
+            vm->stackTop = &R(base + 1);
+            SAVE();
+            if (!bindMethod(superclass, name))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD();
+            DISPATCH();
+        }
+        CASE(REG_GET_METHOD):
+        {
+            uint8_t base = READ_BYTE();
+            ObjString *name = READ_STRING();
+            if (!IS_INSTANCE(R(base)))
+            {
+                SAVE();
+                runtimeError("Only instances have properties");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjInstance *instance = AS_INSTANCE(R(base));
+            Value value;
+            if (tableGet(&instance->fields, name, &value))
+            {
+                R(base) = NIL_VAL;
+                R(base + 1) = value;
+                DISPATCH();
+            }
+            if (!findMethod(instance->klass, name, &value))
+            {
+                SAVE();
+                runtimeError("Undefined property '%s'", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            R(base + 1) = value;
+            DISPATCH();
+        }
+        CASE(REG_GET_SUPER_METHOD):
+        {
+            uint8_t base = READ_BYTE();
+            ObjString *name = READ_STRING();
+            Value method;
+            if (!findMethod(AS_CLASS(R(base + 1)), name, &method))
+            {
+                SAVE();
+                runtimeError("Undefined property '%s'", name->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            R(base + 1) = method;
+            DISPATCH();
+        }
+        CASE(REG_BUILD_LIST):
+        {
+            uint8_t base = READ_BYTE();
+            int count = READ_BYTE();
+            // the list is kept just above its elements while it is sized
+            vm->stackTop = &R(base + count);
+            SAVE();
+            ObjList *list = newList();
+            push(OBJ_VAL(list));
+            list->elements.values = ALLOCATE(Value, count);
+            list->elements.capacity = count;
+            if (count > 0)
+                memcpy(list->elements.values, &R(base), sizeof(Value) * count);
+            list->elements.count = count;
+            R(base) = OBJ_VAL(list);
+            LOAD();
+            DISPATCH();
+        }
+        CASE(REG_BUILD_MAP):
+        {
+            uint8_t base = READ_BYTE();
+            int count = READ_BYTE();
+            // the pairs stay in their registers until the map holds them
+            vm->stackTop = &R(base + 2 * count);
+            SAVE();
+            ObjMap *map = newMap();
+            push(OBJ_VAL(map));
+            for (int i = 0; i < count; i++)
+            {
+                if (!mapSet(map, R(base + 2 * i), R(base + 2 * i + 1)))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+            }
+            R(base) = OBJ_VAL(map);
+            LOAD();
+            DISPATCH();
+        }
+        }
+    }
+#undef SAVE
+#undef LOAD
+#undef READ_BYTE
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_SHORT
+#undef R
+#undef ENTER
+#undef NUMBER_OP
+#undef ADD_OP
+#undef EQUAL_OP
+#undef JUMP_UNLESS
+#undef JUMP_UNLESS_EQUAL
+#undef CASE
+#undef DISPATCH
+}
+
+// run the frames above baseFrame on the machine the frame on top runs
+static InterpretResult runFrames(int baseFrame)
+{
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    ObjFunction *function = frame->closure->function;
+    if (frameChunk(frame) == &functionState(function)->registers)
+        return runRegisters(baseFrame);
+    return run(baseFrame);
+}
+
+InterpretResult interpret(VM *instance, const char *source)
+{
+    vm = instance;
     ObjFunction *function = compile(source);
     if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(instance, function);
+}
+
+InterpretResult interpretFunction(VM *instance, ObjFunction *function)
+{
+    vm = instance;
 
     // push and pop function for GC
     push(OBJ_VAL(function));
@@ -669,7 +2743,52 @@ InterpretResult interpret(const char *source)
     ObjClosure *closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
-    call(closure, 0);
 
-    return run();
+    // the script may be run by a native, on top of the code calling it
+    int baseFrame = vm->frameCount;
+    if (!call(closure, 0))
+        return INTERPRET_RUNTIME_ERROR;
+    InterpretResult result = runFrames(baseFrame);
+    if (result == INTERPRET_OK)
+        pop();
+    return result;
+}
+
+InterpretResult callFromHost(Value callee, int argCount, const Value *args,
+                             Value *result)
+{
+    if (vm->hostCallDepth == HOST_CALLS_MAX)
+    {
+        runtimeError("Stack overflow");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    // args may point into the stack, which moves when it grows
+    Value copies[UINT8_COUNT];
+    memcpy(copies, args, sizeof(Value) * argCount);
+    // the running frame only reserved room for its own values
+    int needed = (int)(vm->stackTop - vm->stack) + argCount + 1 + STACK_SLACK;
+    if (needed > vm->stackCapacity && !growStack(needed))
+    {
+        runtimeError("Stack overflow");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    push(callee);
+    for (int i = 0; i < argCount; i++)
+    {
+        push(copies[i]);
+    }
+
+    // natives and classes without an initializer are done by callValue
+    int baseFrame = vm->frameCount;
+    vm->hostCallDepth++;
+    InterpretResult called = INTERPRET_RUNTIME_ERROR;
+    if (callValue(callee, argCount))
+        called = vm->frameCount > baseFrame ? runFrames(baseFrame)
+                                            : INTERPRET_OK;
+    vm->hostCallDepth--;
+
+    if (called == INTERPRET_OK)
+        *result = pop();
+    return called;
 }
\ No newline at end of file
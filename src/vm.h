@@ -6,8 +6,54 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
+// the call frames and the value stack start small and grow on demand up to
+// vm->framesMax and vm->stackMax, which default to these
+#define FRAMES_INITIAL 16
+#define FRAMES_MAX (1 << 14)
+#define STACK_INITIAL (UINT8_COUNT * 4)
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// every call reserves the max stack size of its function above the frame, so
+// instructions can push without checking for room
+//
+// runtime helpers may push a couple of values on top of that to keep objects
+// safe from GC
+#define STACK_SLACK 4
+
+// vm->tierUp is called when a function has been called, or one of its loops
+// has jumped back, this many times
+#define HOT_CALL_THRESHOLD 1000
+#define HOT_LOOP_THRESHOLD 10000
+
+// calls from C into lox code (natives calling back included) can nest this
+// deep, every level uses the C stack
+#define HOST_CALLS_MAX 200
+
+// loop is the index of the hot loop in the function, or -1 when the function
+// itself got hot
+//
+// it runs in the middle of an instruction, so it must leave the stack alone
+typedef void (*TierUpFn)(ObjFunction *function, int loop);
+
+// what running a function makes or counts, kept in vm->functionStates and
+// indexed by the id of the function like the marks, so a frozen function
+// stays untouched and its heap page shared
+typedef struct
+{
+    // how many times the function was called and each of its loops jumped
+    // back, the counters saturate instead of wrapping
+    uint32_t callCount;
+    uint32_t *loopCounters;
+    // a function without upvalues always makes the same closure, so the first
+    // one made is shared by every evaluation of its declaration
+    ObjClosure *closure;
+    // the translation of chunk run by the register machine, made the first
+    // time the function is called there, its constants are those of chunk
+    Chunk registers;
+    // the translation failed, the register machine runs chunk instead
+    bool stackOnly;
+    // the machine code of chunk, made by --jit once the function is hot
+    struct JitCode *native;
+} FunctionState;
 
 typedef struct
 {
@@ -18,38 +64,106 @@ typedef struct
     // slots points to the VM's value stack at the slot
     // that this function can use
     Value *slots;
+    // how many of the frame's slots are captured by open upvalues
+    int openUpvalueCount;
 
 } CallFrame;
 
-typedef struct
+// a .loxc file whose code and lines are used in place by the functions loaded
+// from it
+typedef struct MappedFile
+{
+    void *start;
+    size_t size;
+    struct MappedFile *next;
+} MappedFile;
+
+// a value pinned by the host through the embedding API, it is a GC root until
+// it is unpinned
+typedef struct Handle
+{
+    Value value;
+    struct Handle *previous;
+    struct Handle *next;
+} Handle;
+
+typedef struct VM
 {
-    // frames are not heap allocated because they should be fast
-    CallFrame frames[FRAMES_MAX];
+    // frames grow by reallocating, so pointers to them must be reloaded
+    // after a call
+    CallFrame *frames;
     int frameCount;
+    int frameCapacity;
+    int framesMax;
 
     // VM stack for executing instructions
-    Value stack[STACK_MAX];
+    //
+    // growing moves it, and all pointers into it (frame slots, open
+    // upvalues) are relocated
+    Value *stack;
+    int stackCapacity;
+    int stackMax;
     // the top points just after the top element of stack
     // so empty when stackTop points to 0
     Value *stackTop;
+    // one past the last slot reserved for a frame since the last collection,
+    // the register machine leaves values above the top up to there
+    int stackReserved;
     Table globals;
     Table strings;
-    // linked list of open upValues owned by VM
-    ObjUpvalue *openUpvalues;
+    // open upvalues owned by VM, indexed by the stack slot they point to and
+    // NULL for slots which are not captured, it has the stack's capacity
+    ObjUpvalue **openUpvalues;
     // pointer to head of ll of objects
     Obj *objects;
+    // objects which survived freezeHeap, they are never swept
+    Obj *immortalObjects;
+    // immortal objects which were written to after the freeze
+    Obj **remembered;
+    int rememberedCount;
+    int rememberedCapacity;
 
     // gray stack for GC
     int grayCount;
     int grayCapacity;
     Obj **grayStack;
 
+    // one byte of GC state per object id, outside the objects so a child
+    // process collecting garbage keeps sharing the heap pages of its parent
+    uint8_t *marks;
+    uint32_t idCount;
+    uint32_t idCapacity;
+    // the ids of freed objects, reused first
+    uint32_t *freeIds;
+    uint32_t freeIdCount;
+    uint32_t freeIdCapacity;
+    // only the ids of functions have an initialized entry
+    FunctionState *functionStates;
+    uint32_t functionStateCapacity;
+
     // how frequently GC should run
     size_t bytesAllocated;
     size_t nextGC;
 
     // the init function string is interned and stored in vm itself
     ObjString *initString;
+
+    // every name which has been defined as a method, indexed by its method
+    // slot
+    ValueArray methodNames;
+
+    // where an optimizing backend plugs in, NULL when there is none
+    TierUpFn tierUp;
+    // run the translation of every function for the register machine instead
+    // of its stack code, chosen before anything runs
+    bool registerMachine;
+    // compile binary operators on locals to the fused _LL and _LK forms,
+    // turned off by --no-register-ops
+    bool registerOperands;
+
+    MappedFile *mappedFiles;
+    Handle *handles;
+    int hostCallDepth;
 } VM;
 
 typedef enum
@@ -59,13 +173,45 @@ typedef enum
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-// expos the global vm object
-extern VM vm;
+// the current VM of the calling thread, everything which allocates objects or
+// runs code works on it
+//
+// VMs share nothing, so several of them can run on different threads at once,
+// but one VM must only be used by one thread at a time
+extern _Thread_local VM *vm;
+
+static inline FunctionState *functionState(ObjFunction *function)
+{
+    return &vm->functionStates[function->obj.id];
+}
 
-void initVM();
-void freeVM();
-InterpretResult interpret(const char *source);
+// a new VM, which becomes the current one
+VM *newVM();
+// the thread is left without a current VM if it was the one freed
+void freeVM(VM *instance);
+void setVM(VM *instance);
+#ifdef BASELINE_JIT
+// compile functions to machine code as they get hot, chosen before anything
+// runs
+void enableJit(VM *instance);
+#endif
+// these make the VM the current one before running
+InterpretResult interpret(VM *instance, const char *source);
+// run a script which has already been compiled
+InterpretResult interpretFunction(VM *instance, ObjFunction *function);
 void push(Value value);
 Value pop();
+// report an error with the trace of the running frames and reset the stack
+void runtimeError(const char *format, ...);
+// call a value from C, either while the VM is idle or from a native, and
+// return once that call returns
+//
+// a runtime error has been reported, and has reset the whole stack, when it
+// fails, a native getting that must return false as well
+InterpretResult callFromHost(Value callee, int argCount, const Value *args,
+                             Value *result);
+// in clox.c, false and an error message in result when the native failed
+bool callHostNative(ObjNative *native, int argCount, Value *args,
+                    Value *result);
 
 #endif
\ No newline at end of file